@@ -2,29 +2,58 @@
 
 #include <string>
 #include <string_view>
+#include <vector>
 #include <functional>
+#include <memory>
+#include <atomic>
+#include <chrono>
 
 namespace llama_server {
 
 	using LlamaToken = int32_t;
 
+	struct ContextConfig {
+		uint32_t n_ctx = 8192;			// text context, 0 = from model
+		uint32_t n_batch = 1024;		// logical maximum batch size that can be submitted to llama_decode
+		uint32_t n_ubatch = 512;		// physical maximum batch size
+		uint32_t n_cache_reuse = 0;		// min tokens of a run after a mid-history change kept by shifting the KV, 0 = reuse the common prefix only
+	};
+
 	struct ModelConfig {
 		std::string model_path;
 		int32_t n_gpu_layers = -1;		// number of layers to store in VRAM
 		bool	use_mmap = true;		// use mmap if possible
 		bool	use_mlock = false;		// force system to keep model in RAM
+		bool	warmup = false;			// page in the weights and run a dummy decode before load_model returns
 
 		std::string mtmd_path;			// path to multimodel
 		int image_min_tokens = -1;		// minimum number of text_tokens for image input (default: read from metadata)
 		int image_max_tokens = -1;		// maximum number of text_tokens for image input (default: read from metadata)
-	};
+		size_t media_cache_bytes = 256ull << 20;	// preprocessed media shared by all sessions, keyed by content, least recently used evicted
+		size_t embedding_cache_bytes = 512ull << 20;	// encoder output kept in memory, so media whose KV was lost are not encoded again
+		std::string embedding_cache_dir;		// optional directory keeping encoder outputs across runs, read back memory mapped
 
-	struct ContextConfig {
-		uint32_t n_ctx = 8192;			// text context, 0 = from model
-		uint32_t n_batch = 1024;		// logical maximum batch size that can be submitted to llama_decode
-		uint32_t n_ubatch = 512;		// physical maximum batch size
+		std::string draft_model;		// name of a loaded model with the same vocabulary, enables speculative decoding
+
+		uint32_t n_parallel = 0;		// continuous batching: max sessions sharing one context (0 = every session owns its context)
+		ContextConfig batch_context = {	// shared context used when n_parallel > 0, n_ctx is the unified KV of all sessions
+			.n_ctx = 32768,
+			.n_batch = 2048,
+			.n_ubatch = 512,
+		};
+		uint32_t prefix_cache_slots = 0;		// cross-session prompt prefix cache (needs n_parallel > 0), extra sequences keeping prefixes, 0 = disabled
+		uint32_t prefix_cache_tokens = 16384;	// token budget of all cached prefixes, least recently used ones are evicted
+
+		uint32_t context_pool_min = 0;	// warm contexts kept ready per ContextConfig (ignored when n_parallel > 0)
+		uint32_t context_pool_max = 0;	// idle contexts kept per ContextConfig after their session ends, 0 = no pooling
+
+		uint32_t max_active = 0;		// generations decoding at once, others wait by priority (0 = no admission control)
+		uint32_t max_queued = 64;		// waiting generations, further requests are rejected
+		std::chrono::milliseconds queue_timeout = std::chrono::seconds(30);
 	};
 
+	using LoadProgressCallback = std::function<bool(float progress)>;	// return false to cancel loading
+
 	struct GrammarTrigger {
 		enum TriggerType {
 			TOKEN, WORD, PATTERN, PATTERN_FULL,
@@ -41,11 +70,31 @@ namespace llama_server {
 		std::vector<GrammarTrigger>			triggers;	// optional triggers (for lazy grammars)
 	};
 
+	// Generation ends right after the first stop string or stop token, which is still part of the output.
+	struct StopCondition {
+		std::vector<std::string>			strings;	// matched across token boundaries
+		std::vector<LlamaToken>				tokens;
+	};
+
+	enum class Priority { BATCH, NORMAL, INTERACTIVE };
+
+	// Copies share one flag: keep a copy and cancel() from any thread to stop a generation, including its prefill.
+	class CancellationToken {
+	public:
+		void cancel() const { flag_->store(true); }
+		bool is_cancelled() const { return flag_->load(); }
+	private:
+		std::shared_ptr<std::atomic<bool>> flag_ = std::make_shared<std::atomic<bool>>(false);
+	};
+
 	using OutputCallback = std::function<bool(std::string&&)>;
 	using ToolCallback = std::function<std::string(std::string_view json_str)>;
 	struct GenConfig {
 		uint32_t	max_tokens = 1024;
 		bool		enable_thinking = true;
+		uint32_t	n_draft = 8;				// max tokens proposed per speculative step (0 = no speculative decoding)
+		uint32_t	lookup_ngram = 0;			// without a draft model: propose what followed the last n tokens earlier in the prompt (0 = off)
+		bool		jump_forward = false;		// with a grammar: emit the tokens it forces without sampling and decode them in one batch
 
 		float		temperature = 1.0f;
 		float		top_p = 0.0f;
@@ -57,9 +106,15 @@ namespace llama_server {
 		float		penalty_present = 0.0f;
 
 		Grammar		grammar;
+		StopCondition stop;
 
 		bool		add_generation_prompt = true;
 		OutputCallback output_callback = nullptr;
+
+		CancellationToken cancellation;
+		std::chrono::steady_clock::time_point deadline = {};	// prefill and decoding stop when reached, default: none
+
+		Priority	priority = Priority::NORMAL;	// with ModelConfig::max_active, lower priorities are preempted for higher ones
 	};
 
 }
\ No newline at end of file
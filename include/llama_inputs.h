@@ -1,11 +1,24 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
 
 namespace llama_server {
+    // Media passed in memory, referenced from the content as <__media:handle__>.
+    // The buffer is shared, not copied, until the media is preprocessed.
+    struct Media {
+        std::string handle;
+        std::shared_ptr<const std::string> data;    // an encoded image/audio file, or RGB pixels if width and height are set
+        uint32_t width = 0;
+        uint32_t height = 0;
+    };
+
     struct Message {
         std::string role;
         std::string content;
+        std::vector<Media> media;
     };
 
     struct Tool {
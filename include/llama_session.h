@@ -6,20 +6,48 @@
 #include "llama_inputs.h"
 
 #include <memory>
+#include <string>
+#include <optional>
 
 namespace llama_server {
 
 	namespace internal {
 		class LlamaModel;
 		class LlamaContext;
+		class BatchEngine;
+		class ContextPool;
 		class InputEncoder;
 		class KVScheduler;
 		class Tokenizer;
 		class Templater;
 		class Sampler;
 		class Streamer;
+		class Drafter;
+		class Generator;
+		class RequestScheduler;
 	}
-	
+
+	// Pull-based output of LlamaSession::generate_stream, decoding happens while the stream is read.
+	// One thread can drive many streams by reading those which are ready(), though ready() still decodes in the
+	// calling thread when the stream is admitted (prompt prefill), jumps forward over grammar forced tokens,
+	// verifies drafted tokens, or is paused or resumed by preemption.
+	// The stream borrows its session and must not outlive it, a new generation on the session ends it.
+	class TokenStream {
+	public:
+		// Blocks until the next piece of text is decoded, nullopt once generation has finished.
+		std::optional<std::string> next();
+		// True if next() does not wait for a decode. Submits the next decode when there is none in flight,
+		// the prefill, jump-forward, speculation and preemption decodes above are run before returning.
+		bool ready();
+		bool finished() const;
+		// Ends generation after the decode in flight, unread text is dropped.
+		void stop();
+	private:
+		friend class LlamaSession;
+		explicit TokenStream(internal::Generator* generator) : generator_(generator) {}
+
+		internal::Generator* generator_;
+	};
 
 	class LlamaSession {
 	public:
@@ -27,6 +55,14 @@ namespace llama_server {
 			ContextConfig context_config,
 			std::shared_ptr<internal::LlamaModel> model
 		);
+		LlamaSession(
+			ContextConfig context_config,
+			std::shared_ptr<internal::BatchEngine> engine
+		);
+		LlamaSession(
+			ContextConfig context_config,
+			std::shared_ptr<internal::ContextPool> context_pool
+		);
 		~LlamaSession();
 
 		LlamaSession(const LlamaSession&) = delete;
@@ -41,18 +77,49 @@ namespace llama_server {
 			const GenConfig& gen_config
 		);
 
+		// Prefills the prompt and returns at once, gen_config.output_callback is not used.
+		// When the model's admission is full the stream is returned queued, it is admitted and prefilled while it is read.
+		TokenStream generate_stream(
+			std::vector<Message> head_msgs,
+			std::vector<Message> tail_msgs,
+			std::vector<Tool> tools,
+			const GenConfig& gen_config
+		);
+
 		void set_token_estimate_strategy(TokenEstimateStrategy&& strategy);
+
+		// Enables speculative decoding, ignored with a warning if the vocabularies differ.
+		void set_draft_model(std::shared_ptr<internal::LlamaModel> draft_model);
+		// Generations wait for admission before prefilling.
+		void set_scheduler(std::shared_ptr<internal::RequestScheduler> scheduler);
+
+		// Saves/restores the KV cache of the session, throws LlamaException on failure.
+		void save_state(std::string path) const;
+		void load_state(std::string path);
 	private:
+		void init_components();
+
+		// The context goes back to the pool when the session is destroyed.
+		ContextConfig context_config_;
+		std::shared_ptr<internal::ContextPool> context_pool_ = nullptr;
+
 		std::unique_ptr<internal::LlamaContext> context_;
+		// Keeps the model resident while the session is alive.
+		std::shared_ptr<void> model_lease_;
 
 		std::unique_ptr<internal::Tokenizer> tokenizer_;
-		std::unique_ptr<internal::Templater> templater_;
 
         std::unique_ptr<internal::InputEncoder> input_encoder_;
 		std::unique_ptr<internal::KVScheduler> kv_scheduler_;
 
 		std::unique_ptr<internal::Sampler> sampler_;
 		std::unique_ptr<internal::Streamer> streamer_;
+
+		std::unique_ptr<internal::Drafter> drafter_;
+		std::shared_ptr<internal::RequestScheduler> scheduler_;
+
+		// Last, it borrows the components above.
+		std::unique_ptr<internal::Generator> generator_;
 	};
 
 }
\ No newline at end of file
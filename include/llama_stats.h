@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+namespace llama_server {
+
+	struct ModelStats {
+		bool resident = false;				// false once evicted by the memory budget
+		uint64_t memory_bytes = 0;			// weights, mtmd and contexts
+		double warmup_ms = 0;				// time spent in ModelConfig::warmup
+		bool warmed_up = false;				// the warm-up decode ran, false when it failed or was not asked for
+
+		uint64_t draft_tokens = 0;			// tokens proposed by the draft model
+		uint64_t draft_accepted = 0;		// proposals the model agreed with, acceptance rate = draft_accepted / draft_tokens
+		uint64_t lookup_tokens = 0;			// tokens proposed by prompt lookup
+		uint64_t lookup_accepted = 0;
+
+		uint64_t requests_rejected = 0;		// turned away because the queue was full
+		uint64_t requests_timed_out = 0;	// gave up waiting in the queue
+		uint64_t preemptions = 0;			// generations paused for a higher priority request
+		uint64_t context_pool_hits = 0;		// sessions served with a warm context
+		uint64_t context_pool_misses = 0;	// sessions which had to create their context
+		uint64_t grammar_cache_hits = 0;	// grammars cloned from an already compiled one
+		uint64_t grammar_cache_misses = 0;	// grammars which had to be parsed and compiled
+		uint64_t token_cache_hits = 0;		// texts of at least 64 bytes whose tokens were shared
+		uint64_t token_cache_misses = 0;
+		uint64_t media_cache_hits = 0;		// media whose preprocessing was shared
+		uint64_t media_cache_misses = 0;
+		uint64_t media_cache_bytes = 0;		// preprocessed media held, bounded by ModelConfig::media_cache_bytes
+		uint64_t embedding_cache_hits = 0;	// media prefilled without running the encoder
+		uint64_t embedding_cache_disk_hits = 0;	// of which were read from ModelConfig::embedding_cache_dir
+		uint64_t embedding_cache_misses = 0;	// media which had to be encoded
+	};
+
+}
\ No newline at end of file
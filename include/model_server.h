@@ -3,19 +3,26 @@
 #include "llama_exception.h"
 #include "llama_configs.h"
 #include "llama_session.h"
+#include "llama_stats.h"
 
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <atomic>
 #include <shared_mutex>
 #include <condition_variable>
+#include <future>
 
 namespace llama_server {
 
 	namespace internal {
 		class LlamaModel;
+		class BatchEngine;
+		class ContextPool;
+		class ThreadPool;
+		class RequestScheduler;
 	}
 
 	class ModelServer {
@@ -29,23 +36,60 @@ namespace llama_server {
 		ModelServer& operator=(ModelServer&&) = delete;
 
 		void load_model(const ModelConfig& config, std::string name);
+		// Loads on a bounded loader pool, several models load in parallel.
+		std::shared_future<void> load_model_async(
+			const ModelConfig& config,
+			std::string name,
+			LoadProgressCallback progress_callback = nullptr
+		);
 		void unload_model(std::string name);
 
+		// Models without live sessions are evicted least recently used first to stay under bytes, 0 disables the budget.
+		// An evicted model is reloaded from its config by the next get_session.
+		void set_memory_budget(size_t bytes);
+
 		std::unique_ptr<LlamaSession> get_session(
 			std::string model_name,
 			ContextConfig context_config
+		);
+
+		// Creates warm contexts for context_config up to ModelConfig::context_pool_min.
+		void prewarm_contexts(
+			std::string model_name,
+			ContextConfig context_config
 		) const;
 
+		ModelStats get_model_stats(std::string model_name) const;
+
 	private:
 		ModelServer();
 		~ModelServer();
 
+		void load_model_impl(const ModelConfig& config, std::string name, const LoadProgressCallback& progress_callback);
+		// Pages in the weights and runs a dummy decode, records the elapsed time on the model.
+		void warm_up(
+			const ModelConfig& config,
+			const std::shared_ptr<internal::LlamaModel>& model,
+			const std::shared_ptr<internal::BatchEngine>& engine
+		);
+		// Must hold mutex_ exclusively. Returns the evicted objects so they can be freed after unlocking.
+		std::vector<std::shared_ptr<void>> evict_for(size_t incoming_bytes, const std::string& keep);
+
 		mutable std::shared_mutex mutex_;
 		mutable std::condition_variable_any loading_model_cv_;
 		std::atomic<bool> shutdown_flag_;
 
 		std::unordered_map<std::string, std::shared_ptr<internal::LlamaModel>> model_map_;
+		std::unordered_map<std::string, std::shared_ptr<internal::BatchEngine>> engine_map_;
+		std::unordered_map<std::string, std::shared_ptr<internal::ContextPool>> context_pool_map_;
+		std::unordered_map<std::string, std::shared_ptr<internal::RequestScheduler>> scheduler_map_;
+		std::unordered_map<std::string, ModelConfig> config_map_;		// kept for evicted models until unload_model
+		size_t memory_budget_ = 0;
 		std::unordered_set<std::string> loading_model_set_;
+
+		// Declared last, so at exit it is joined before the state its loads use is destroyed. Null after shutdown.
+		static constexpr size_t max_parallel_loads = 4;
+		std::unique_ptr<internal::ThreadPool> loader_pool_;
 	};
 
 	class ServerShutdownException : public LlamaException {
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "prefix_cache.h"
+#include "llama.h"
+
+#include <memory>
+#include <vector>
+#include <span>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <functional>
+#include <condition_variable>
+
+namespace llama_server::internal {
+
+	class LlamaModel;
+
+	// One llama_context with unified KV shared by many sessions, each session owns a llama_seq_id.
+	// Pending decode tokens and prefill chunks of all sessions are merged into one llama_decode per iteration.
+	class BatchEngine {
+	public:
+		// The last n_prefix_slots sequences are reserved for the cross-session prefix cache.
+		BatchEngine(
+			const llama_context_params& params,
+			std::shared_ptr<LlamaModel> model,
+			uint32_t n_prefix_slots = 0,
+			size_t n_prefix_tokens = 0
+		);
+		~BatchEngine();
+
+		BatchEngine(const BatchEngine&) = delete;
+		BatchEngine& operator=(const BatchEngine&) = delete;
+		BatchEngine(BatchEngine&&) = delete;
+		BatchEngine& operator=(BatchEngine&&) = delete;
+
+		llama_context* get_data() const { return context_.get(); }
+		LlamaModel& get_model() const { return *model_; }
+		const std::shared_ptr<LlamaModel>& get_model_ptr() const { return model_; }
+
+		size_t get_n_ctx() const;
+		size_t get_n_vocab() const;
+
+		// Reserves n_ctx KV cells for the sequence, throws LlamaException if the context cannot hold them besides the others.
+		llama_seq_id acquire_seq(uint32_t n_ctx);
+		void release_seq(llama_seq_id seq_id);
+
+		enum class Logits { NONE, LAST, ALL };
+
+		// Blocks until all tokens are decoded. Requested logits are copied to logits_out, one row of n_vocab per token for ALL.
+		// abort_check is polled between batches, the shared context itself is never aborted.
+		void decode(
+			llama_seq_id seq_id,
+			std::span<const llama_token> tokens,
+			Logits logits,
+			float* logits_out,
+			std::function<bool()> abort_check = nullptr
+		);
+		// Queues the request and returns at once, tokens and logits_out must stay valid until the future is ready.
+		std::future<void> submit(
+			llama_seq_id seq_id,
+			std::span<const llama_token> tokens,
+			Logits logits,
+			float* logits_out,
+			std::function<bool()> abort_check = nullptr
+		);
+
+		// Copies the longest cached prompt prefix into seq_id if it is longer than n_min, returns its length or 0.
+		size_t restore_prefix(llama_seq_id seq_id, std::span<const PrefixCache::Key> keys, size_t n_min);
+		void store_prefix(llama_seq_id seq_id, std::span<const PrefixCache::Key> keys);
+		bool has_prefix_cache() const { return prefix_cache_ != nullptr; }
+
+		// Runs fn with exclusive access to the shared context, between two batches.
+		template <typename F>
+		decltype(auto) exclusive(F&& fn) {
+			std::lock_guard lock(context_mutex_);
+			return fn(context_.get());
+		}
+
+	private:
+		struct ContextDeleter {
+			void operator()(llama_context* context) const;
+		};
+
+		struct DecodeRequest {
+			llama_seq_id seq_id;
+			std::span<const llama_token> tokens;
+			Logits logits;
+			float* logits_out;
+			std::function<bool()> abort_check;
+
+			size_t n_done = 0;
+			llama_pos pos = -1;
+			std::promise<void> done;
+		};
+
+		std::shared_ptr<LlamaModel> model_;
+		std::unique_ptr<llama_context, ContextDeleter> context_;
+		size_t kv_bytes_ = 0;
+
+		llama_batch batch_;
+		std::mutex context_mutex_;
+
+		std::unique_ptr<PrefixCache> prefix_cache_ = nullptr;
+
+		std::mutex queue_mutex_;
+		std::condition_variable queue_cv_;
+		std::vector<std::shared_ptr<DecodeRequest>> pending_;
+		std::vector<uint32_t> seq_n_ctx_;		// KV cells reserved by each session sequence, 0 = free
+		size_t n_reserved_ = 0;
+		bool stop_ = false;
+
+		std::thread worker_;
+
+		void loop();
+	};
+
+}
\ No newline at end of file
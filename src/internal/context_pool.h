@@ -0,0 +1,64 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "llama_configs.h"
+
+#include <map>
+#include <tuple>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+
+namespace llama_server::internal {
+
+	class LlamaModel;
+	class LlamaContext;
+
+	// Warm, cleared contexts of one model, keyed by ContextConfig.
+	class ContextPool {
+	public:
+		ContextPool(
+			std::shared_ptr<LlamaModel> model,
+			size_t n_min,
+			size_t n_max
+		);
+		~ContextPool();
+
+		ContextPool(const ContextPool&) = delete;
+		ContextPool& operator=(const ContextPool&) = delete;
+
+		std::unique_ptr<LlamaContext> acquire(const ContextConfig& config);
+		void release(const ContextConfig& config, std::unique_ptr<LlamaContext> context);
+
+		// Creates idle contexts for config until n_min of them are ready.
+		void prewarm(const ContextConfig& config);
+
+		uint64_t get_hits() const { return n_hits_; }
+		uint64_t get_misses() const { return n_misses_; }
+	private:
+		using Key = std::tuple<uint32_t, uint32_t, uint32_t>;
+
+		std::shared_ptr<LlamaModel> model_;
+		size_t n_min_;
+		size_t n_max_;
+
+		std::mutex mutex_;
+		std::condition_variable refill_cv_;
+		std::map<Key, std::vector<std::unique_ptr<LlamaContext>>> idle_;
+		std::vector<ContextConfig> refill_queue_;
+		bool stop_ = false;
+
+		std::atomic<uint64_t> n_hits_ = 0;
+		std::atomic<uint64_t> n_misses_ = 0;
+
+		std::thread refill_worker_;
+
+		static Key make_key(const ContextConfig& config) { return { config.n_ctx, config.n_batch, config.n_ubatch }; }
+		std::unique_ptr<LlamaContext> create(const ContextConfig& config) const;
+		void refill_loop();
+	};
+
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "llama.h"
+
+#include <memory>
+#include <vector>
+#include <span>
+
+namespace llama_server::internal {
+
+	class LlamaModel;
+	class LlamaContext;
+
+	// Greedy proposals of a small model sharing the vocabulary of the target, for speculative decoding.
+	class Drafter {
+	public:
+		Drafter(std::shared_ptr<LlamaModel> model, uint32_t n_ctx);
+		~Drafter();
+
+		Drafter(const Drafter&) = delete;
+		Drafter& operator=(const Drafter&) = delete;
+
+		static bool is_compatible(const LlamaModel& target, const LlamaModel& draft);
+
+		// tokens is the whole sequence up to the last sampled token, only the part not yet in the draft KV is decoded.
+		std::vector<llama_token> draft(std::span<const llama_token> tokens, size_t n_draft);
+	private:
+		std::unique_ptr<LlamaContext> context_;
+		// Declared after context_, released before the context drops its model reference.
+		std::shared_ptr<void> model_lease_;
+
+		std::vector<llama_token> tokens_;		// sequence held by the draft KV
+	};
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "llama_exception.h"
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+struct mtmd_input_chunks;
+
+namespace llama_server::internal {
+
+	// Encoder output of the media chunks of one IDChunks, in chunk order.
+	// The floats live in storage, a heap buffer or a mapped file.
+	struct MediaEmbeddings {
+		std::vector<std::span<const float>> chunks;
+		std::shared_ptr<const void> storage;
+
+		size_t get_bytes() const;
+		// True if there is one chunk per media chunk of input, each with n_embd floats per token.
+		bool matches(const mtmd_input_chunks* input, size_t n_embd) const;
+	};
+	using MediaEmbeddingsPtr = std::shared_ptr<const MediaEmbeddings>;
+
+	// Model-level LRU of encoded media keyed by IDChunks id, optionally backed by a directory of embedding files.
+	// Files are named after the media and the identity of the projector, and are memory mapped when read back.
+	class EmbeddingCache {
+	public:
+		EmbeddingCache(size_t byte_budget, std::string_view dir, std::string_view projector_identity);
+		~EmbeddingCache();
+
+		EmbeddingCache(const EmbeddingCache&) = delete;
+		EmbeddingCache& operator=(const EmbeddingCache&) = delete;
+
+		// Looks in memory, then on disk.
+		MediaEmbeddingsPtr find(std::string_view id);
+		void insert(std::string_view id, MediaEmbeddingsPtr embeddings);
+		// Drops the entry from memory and deletes its file, for embeddings which do not fit their media.
+		void remove(std::string_view id);
+		bool has_disk() const { return !dir_.empty(); }
+		// Writes the embeddings to disk, does nothing without a directory or if the file exists.
+		void save(std::string_view id, const MediaEmbeddings& embeddings) const;
+
+		uint64_t get_hits() const { return n_hits_; }
+		uint64_t get_disk_hits() const { return n_disk_hits_; }
+		uint64_t get_misses() const { return n_misses_; }
+	private:
+		struct Entry {
+			std::string id;
+			MediaEmbeddingsPtr embeddings;
+			size_t n_bytes;
+		};
+
+		size_t byte_budget_;
+		std::string dir_;
+		std::string projector_id_;
+
+		std::mutex mutex_;
+		std::list<Entry> entries_;		// most recently used first
+		std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;	// views the id of each entry
+		size_t n_bytes_ = 0;
+
+		std::atomic<uint64_t> n_hits_ = 0;
+		std::atomic<uint64_t> n_disk_hits_ = 0;
+		std::atomic<uint64_t> n_misses_ = 0;
+
+		std::string get_path(std::string_view id) const;
+		MediaEmbeddingsPtr load(std::string_view id) const;
+		void insert_locked(std::string_view id, MediaEmbeddingsPtr embeddings);
+		void erase(std::list<Entry>::iterator it);
+	};
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "llama_configs.h"
+#include "id_chunk.h"
+#include "llama.h"
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <string>
+#include <span>
+#include <future>
+#include <functional>
+
+namespace llama_server::internal {
+
+	class LlamaContext;
+	class Tokenizer;
+	class Sampler;
+	class Streamer;
+	class Drafter;
+	class PromptLookup;
+	class SchedulerTicket;
+
+	// The decode loop of one generation as a state machine, so a caller can interleave many of them.
+	// Text pieces are queued as soon as they are valid UTF-8.
+	class Generator {
+	public:
+		Generator(LlamaContext& context, Sampler& sampler, const Tokenizer& tokenizer, Streamer& streamer);
+		~Generator();
+
+		Generator(const Generator&) = delete;
+		Generator& operator=(const Generator&) = delete;
+
+		// Samples the first token from the prefilled prompt, the sampler must be set.
+		void start(
+			std::span<IDChunksPtr const> chunks,
+			const GenConfig& gen_config,
+			size_t max_tokens,
+			Drafter* drafter,
+			std::unique_ptr<SchedulerTicket> ticket = nullptr
+		);
+
+		// Holds the generation until ticket is admitted, then launch prefills and calls start with the ticket.
+		void queue(std::unique_ptr<SchedulerTicket> ticket, std::function<void(std::unique_ptr<SchedulerTicket>)> launch);
+
+		// Decodes until at least one more token is sampled, returns false without progress if !block and a decode is in flight.
+		bool step(bool block);
+		// Waits for the decode in flight and finishes, queued text is dropped.
+		void stop();
+
+		bool is_finished() const { return finished_; }
+		bool has_output() const { return !output_.empty(); }
+		std::string pop_output();
+	private:
+		LlamaContext& context_;
+		Sampler& sampler_;
+		const Tokenizer& tokenizer_;
+		Streamer& streamer_;
+
+		Drafter* drafter_ = nullptr;
+		std::unique_ptr<PromptLookup> lookup_;
+		uint32_t n_draft_ = 0;
+		bool jump_forward_ = false;
+		std::vector<llama_token> stop_tokens_;
+		std::vector<llama_token> history_;		// text of the KV followed by next_token_, only kept for speculation
+
+		size_t max_tokens_ = 0;
+		size_t n_generated_ = 0;
+		size_t n_drafted_ = 0;
+		size_t n_accepted_ = 0;
+		size_t n_jumped_ = 0;
+
+		llama_token next_token_ = LLAMA_TOKEN_NULL;	// sampled, not decoded yet
+		std::future<void> pending_;				// decode of next_token_ in flight
+
+		std::unique_ptr<SchedulerTicket> ticket_;		// admitted place, released when finished
+		std::vector<uint8_t> snapshot_;					// sequence state while preempted
+		bool paused_ = false;
+		std::function<void(std::unique_ptr<SchedulerTicket>)> launch_;		// set while waiting for admission
+
+		std::string buffer_;
+		std::deque<std::string> output_;
+		bool finished_ = true;
+
+		// Queues the text of a sampled token, returns false if generation ends with it.
+		bool accept(llama_token token);
+		// Emits the tokens the grammar forces and decodes them in one batch, returns false if none is forced.
+		bool jump();
+		// Proposes, verifies and rolls back one speculative round, returns false if nothing was proposed.
+		bool speculate();
+		// Preempted: hands the slot to a higher priority request, a shared KV is snapshotted and freed meanwhile.
+		void pause();
+		void resume();
+		void finish();
+	};
+
+}
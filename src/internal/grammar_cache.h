@@ -0,0 +1,57 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "llama_configs.h"
+
+#include <memory>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+struct llama_sampler;
+struct llama_vocab;
+
+namespace llama_server::internal {
+
+	// Model-level cache of compiled grammar samplers, keyed by the grammar text and its triggers.
+	// Callers get clones, so the parse and compile cost of a grammar is paid once per model.
+	class GrammarCache {
+	public:
+		GrammarCache(const llama_vocab* vocab, size_t capacity);
+		~GrammarCache();
+
+		GrammarCache(const GrammarCache&) = delete;
+		GrammarCache& operator=(const GrammarCache&) = delete;
+
+		// Returns a grammar sampler in its initial state, owned by the caller.
+		llama_sampler* acquire(const Grammar& grammar);
+
+		uint64_t get_hits() const { return n_hits_; }
+		uint64_t get_misses() const { return n_misses_; }
+	private:
+		struct SamplerDeleter {
+			void operator()(llama_sampler* sampler) const;
+		};
+		using SamplerPtr = std::unique_ptr<llama_sampler, SamplerDeleter>;
+
+		struct Entry {
+			SamplerPtr sampler;
+			uint64_t last_used = 0;
+		};
+
+		const llama_vocab* vocab_;
+		size_t capacity_;
+
+		std::mutex mutex_;
+		std::unordered_map<std::string, Entry> entries_;
+		uint64_t tick_ = 0;
+
+		std::atomic<uint64_t> n_hits_ = 0;
+		std::atomic<uint64_t> n_misses_ = 0;
+
+		static std::string make_key(const Grammar& grammar);
+		static llama_sampler* compile(const Grammar& grammar, const llama_vocab* vocab);
+	};
+
+}
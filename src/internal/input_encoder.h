@@ -3,12 +3,15 @@
 #include "llama_exception.h"
 #include "llama_strategy.h"
 #include "id_chunk.h"
+#include "media_encoder.h"
 #include "chat.h"
 
 #include <memory>
 #include <vector>
 #include <string_view>
 #include <unordered_set>
+#include <unordered_map>
+#include <functional>
 
 namespace llama_server {
 	class TokenEstimateStrategy;
@@ -20,10 +23,6 @@ namespace llama_server::internal {
 	class Templater;
     class Tokenizer;
 
-	namespace input_encoder_detail {
-		class MediaHelper;
-	}
-
 	class InputEncoder {
 	public:
 		InputEncoder(
@@ -34,6 +33,7 @@ namespace llama_server::internal {
 		);
 		~InputEncoder();
 
+		// Uses and then drops the media bound since the last call.
 		std::vector<IDChunksPtr> operator()(
 			std::vector<common_chat_msg>&& head_msgs,
 			std::vector<common_chat_msg>&& tail_msgs,
@@ -41,25 +41,43 @@ namespace llama_server::internal {
 			size_t max_tokens
 		);
 
+		// Keeps the in-memory media of one message for the next call and returns its content with their handles resolved.
+		// Handles are scoped to the message, throws LlamaException on a duplicate handle or invalid media.
+		std::string bind_media(std::string content, std::vector<Media>&& media);
+		// Drops the media bound since the last call, when the messages binding them are not encoded after all.
+		void clear_media() { media_.clear(); }
+
 		size_t get_used_messages_cache();
 		common_chat_params get_chat_params_cache();
 
-		void set_token_estimate_strategy(TokenEstimateStrategy&& strategy) { token_estimate_strategy_ = std::move(strategy); }
+		void set_token_estimate_strategy(TokenEstimateStrategy&& strategy) {
+			token_estimate_strategy_ = std::move(strategy);
+			estimate_cache_.clear();
+		}
 	private:
         const LlamaContext& context_;
 		const Templater& templater_;
 		const Tokenizer& tokenizer_;
-		std::unique_ptr<input_encoder_detail::MediaHelper> media_helper_;
 
 		TokenEstimateStrategy token_estimate_strategy_;
 
-		std::unordered_set<IDChunksPtr, IDChunksPtrHash, IDChunksPtrEqual> image_chunks_cache_;
-
 		size_t used_messages_cache_ = 0;
 		common_chat_params chat_params_cache_;
 
+		// In-memory media of the next call by content id.
+		std::unordered_map<std::string, MediaBuffer> media_;
+
+		struct Estimate {
+			size_t n_tokens;
+			uint64_t last_pass;
+		};
+		// Token estimates of rendered messages and tool sets by content hash, so a turn only renders what is new.
+		std::unordered_map<uint64_t, Estimate> estimate_cache_;
+		uint64_t estimate_pass_ = 0;
+
 		size_t estimate_text_tokens(std::string_view str);
 		size_t estimate_mtmd_tokens(std::string_view str);
+		size_t estimate_cached(uint64_t key, const std::function<size_t()>& render);
 		common_chat_templates_inputs prune_with_precache(
 			std::vector<common_chat_msg>&& head_msgs,
 			std::vector<common_chat_msg>&& tail_msgs,
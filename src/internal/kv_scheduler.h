@@ -2,12 +2,14 @@
 
 #include "llama_exception.h"
 #include "id_chunk.h"
+#include "prefix_cache.h"
 #include "llama.h"
 #include "mtmd.h"
 
 #include <memory>
 #include <vector>
 #include <span>
+#include <string>
 
 namespace llama_server::internal {
 
@@ -15,26 +17,48 @@ namespace llama_server::internal {
 
     class KVScheduler {
     public:
-        KVScheduler(LlamaContext& context);
+        // Runs of at least n_cache_reuse tokens after the common prefix are kept by shifting the KV, 0 disables it.
+        KVScheduler(LlamaContext& context, size_t n_cache_reuse = 0);
         ~KVScheduler() = default;
 
         [[deprecated("text cache && mtmd cache uses diffirent inner buffer, DO NOT intermix them!")]]
         void prefill_text_cache(std::vector<llama_token> tokens);
         void prefill_mtmd_cache(std::span<IDChunksPtr const> chunks);
         void clear();
+
+        // Sequence state together with the chunks bookkeeping, so a restored session reuses its prefix.
+        void save_state(const std::string& path) const;
+        void load_state(const std::string& path);
     private:
         struct ChunkInfo {
             ChunksType type = (ChunksType)99;
             std::string id;
             std::vector<llama_token> tokens;
+            size_t n_tokens = 0;    // KV positions of a media chunk
+        };
+
+        struct ChunksMatch {
+            size_t kept_chunks;     // chunks identical to the previous ones
+            size_t perfect_keep;    // tokens of the kept chunks
+            size_t last_keep;       // common tokens of the first differing text chunk
         };
 
         LlamaContext& context_;
+        size_t n_cache_reuse_;
 
         // For text generation.
         std::vector<llama_token> prev_tokens_;
 
         std::vector<ChunkInfo> prev_chunks_info_;
+
+        ChunksMatch match_chunks(std::span<IDChunksPtr const> chunks) const;
+        // Moves runs of the previous chunks found after the match to where chunks need them, returns the match afterwards.
+        ChunksMatch reuse_chunks(std::span<IDChunksPtr const> chunks, const ChunksMatch& match);
+        std::vector<PrefixCache::Key> make_prev_keys() const;
+        // Keys map one to one to KV positions, except for media under M-RoPE which cannot be shifted either.
+        bool uses_mrope_media(std::span<IDChunksPtr const> chunks) const;
+        // Rebuilds the bookkeeping for the first n_tokens of chunks, after KV has been restored from elsewhere.
+        void reset_chunks_info(std::span<IDChunksPtr const> chunks, size_t n_tokens);
     };
 
 }
\ No newline at end of file
@@ -2,16 +2,21 @@
 
 #include "llama_exception.h"
 #include "id_chunk.h"
+#include "prefix_cache.h"
 #include "llama.h"
 #include "mtmd.h"
 
 #include <memory>
 #include <vector>
 #include <span>
+#include <future>
+#include <functional>
 
 namespace llama_server::internal {
 
 	class LlamaModel;
+	class BatchEngine;
+	struct MediaEmbeddings;
 
 	class LlamaContext {
 	public:
@@ -19,6 +24,11 @@ namespace llama_server::internal {
 			const llama_context_params& params,
 			std::shared_ptr<LlamaModel> model
 		);
+		// Borrows a sequence of the engine's shared context, n_ctx is the logical limit of this sequence.
+		LlamaContext(
+			std::shared_ptr<BatchEngine> engine,
+			uint32_t n_ctx
+		);
 		~LlamaContext();
 
 		LlamaContext(const LlamaContext&) = delete;
@@ -28,24 +38,52 @@ namespace llama_server::internal {
 
 		bool is_mtmd() const;
 
-		llama_context* get_data() const { return context_.get(); }
+		llama_context* get_data() const;
 		LlamaModel& get_model() const { return *model_; }
 		const llama_vocab* get_vocab() const;
+		llama_seq_id get_seq_id() const { return seq_id_; }
+		bool is_shared() const { return engine_ != nullptr; }
+		const float* get_logits() const;
+		// Logits of the i-th token of the last text_prefill_all.
+		const float* get_logits(size_t i) const;
 
 		size_t get_n_ctx() const;
 		size_t get_n_vocab() const;
-		size_t get_used_memory(llama_seq_id seq_id = 0) const;
+		size_t get_used_memory() const;
 
 		void text_prefill(const llama_token* tokens, size_t n_tokens, bool logits_last = false);
 		void text_prefill(std::span<llama_token> tokens, bool logits_last = false);
+		// Decodes tokens in one batch keeping the logits of every position, tokens must fit into n_batch.
+		void text_prefill_all(std::span<const llama_token> tokens);
 		void mtmd_prefill(std::span<IDChunksPtr const> chunks);
 		void step(llama_token token);
+		// Like step, but returns at once when the context is shared by an engine. An owned context decodes before returning.
+		std::future<void> step_async(llama_token token);
 
 		void KV_cleanup(
 			int32_t head_keep = 0,
-			int32_t tail_spare = -1,
-			llama_seq_id seq_id = 0
+			int32_t tail_spare = -1
 		);
+		// Drops positions [dst, src) and shifts the n_tokens positions from src down to dst.
+		void KV_move(size_t src, size_t dst, size_t n_tokens);
+		bool can_shift() const;
+
+		// Decodes a dummy batch with all weights active to prime allocations, leaves the KV empty.
+		void warm_up();
+
+		std::vector<uint8_t> get_state() const;
+		void set_state(std::span<const uint8_t> state);
+
+		// Cross-session prefix cache, only available when the context is shared by an engine.
+		bool has_prefix_cache() const;
+		size_t restore_prefix(std::span<const PrefixCache::Key> keys, size_t n_min);
+		void store_prefix(std::span<const PrefixCache::Key> keys);
+
+		// Polled during decoding, returning true aborts the running and following decodes of this context.
+		void set_abort_check(std::function<bool()> abort_check);
+		bool is_abort_requested() const;
+
+		static void check_decode(int32_t ret);
 
 	private:
 		struct ContextDeleter {
@@ -55,14 +93,32 @@ namespace llama_server::internal {
 		std::unique_ptr<llama_context, ContextDeleter> context_;
 		std::shared_ptr<LlamaModel> model_;
 
+		std::shared_ptr<BatchEngine> engine_ = nullptr;
+		llama_seq_id seq_id_ = 0;
+		size_t kv_bytes_ = 0;		// accounted to the model, only for an owned context
+		uint32_t n_ctx_ = 0;
+		std::vector<float> logits_;
+		std::vector<float> batch_logits_;		// engine mode, rows of text_prefill_all
+		llama_token step_token_ = 0;			// kept alive for step_async
+
 		std::vector<int8_t> prefill_mask_;
 
+		// Heap allocated, the llama abort callback keeps its address.
+		std::unique_ptr<std::function<bool()>> abort_check_ = std::make_unique<std::function<bool()>>();
+
+		// Runs fn on the underlying llama_context, exclusively if it is shared by an engine.
+		template <typename F>
+		decltype(auto) with_context(F&& fn) const;
+
+		void cleanup_locked(llama_context* context, int32_t head_keep, int32_t tail_spare);
+
 		void eval_single_text_chunks(
 			IDChunksPtr chunks,
 			bool logits_last
 		);
 		void eval_single_mtmd_chunks(
 			IDChunksPtr chunks,
+			const MediaEmbeddings& embeddings,
 			bool logits_last
 		);
 	};
@@ -72,4 +128,10 @@ namespace llama_server::internal {
 		using LlamaException::LlamaException;
 	};
 
+	// The abort check fired, the KV keeps everything decoded before the interrupted batch.
+	class DecodeAbortedException : public LlamaException {
+	public:
+		using LlamaException::LlamaException;
+	};
+
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 
 #include <memory>
 #include <string_view>
+#include <atomic>
+#include <chrono>
 
 using llama_token = int32_t;
 
@@ -16,24 +18,72 @@ struct mtmd_context;
 
 namespace llama_server::internal {
 
+	class Templater;
+	class GrammarCache;
+	class PieceTable;
+	class TokenCache;
+	class MediaCache;
+	class MediaEncoder;
+	class EmbeddingCache;
+
 	class LlamaModel {
 	public:
 		LlamaModel(
 			std::string_view model_path,
 			const llama_model_params& model_params,
 			std::string_view mtmd_path,
-			const mtmd_context_params& mtmd_params
+			const mtmd_context_params& mtmd_params,
+			size_t media_cache_bytes,
+			size_t embedding_cache_bytes,
+			std::string_view embedding_cache_dir
 		);
 		~LlamaModel();
 
 		LlamaModel(const LlamaModel&) = delete;
 		LlamaModel& operator=(const LlamaModel&) = delete;
-		LlamaModel(LlamaModel&&) noexcept;
-		LlamaModel& operator=(LlamaModel&&) noexcept;
+		LlamaModel(LlamaModel&&) = delete;
+		LlamaModel& operator=(LlamaModel&&) = delete;
 
 		llama_model* get_data() const { return model_.get(); }
 		mtmd_context* get_mtmd() const { return mtmd_.get(); }
 		const llama_vocab* get_vocab() const;
+		// Chat templates are parsed once and shared by all sessions.
+		const Templater& get_templater() const { return *templater_; }
+		// Compiled grammars are shared the same way.
+		GrammarCache& get_grammar_cache() const { return *grammar_cache_; }
+		const PieceTable& get_pieces() const { return *pieces_; }
+		// Tokenized texts shared by all sessions, e.g. system prompts and tool schemas.
+		TokenCache& get_token_cache() const { return *token_cache_; }
+		MediaCache& get_media_cache() const { return *media_cache_; }
+		// Only available with mtmd.
+		EmbeddingCache& get_embedding_cache() const { return *embedding_cache_; }
+		// Only available with mtmd.
+		MediaEncoder& get_media_encoder() const { return *media_encoder_; }
+
+		// Bytes held by weights, mtmd and all contexts created from this model.
+		size_t get_footprint() const;
+		// KV cache bytes of a context holding n_ctx positions.
+		size_t estimate_kv_bytes(uint32_t n_ctx) const;
+		void add_context_bytes(size_t bytes) { context_bytes_ += bytes; }
+		void remove_context_bytes(size_t bytes) { context_bytes_ -= bytes; }
+
+		// The model is not evicted while a session lease is alive.
+		std::shared_ptr<void> lease_session();
+		size_t get_n_sessions() const { return n_sessions_; }
+
+		void set_warmup(double ms, bool decoded) { warmup_ms_ = ms; warmed_up_ = decoded; }
+		double get_warmup_ms() const { return warmup_ms_; }
+		bool is_warmed_up() const { return warmed_up_; }
+
+		void record_speculation(size_t n_drafted, size_t n_accepted) { n_drafted_ += n_drafted; n_accepted_ += n_accepted; }
+		uint64_t get_n_drafted() const { return n_drafted_; }
+		uint64_t get_n_accepted() const { return n_accepted_; }
+		void record_lookup(size_t n_drafted, size_t n_accepted) { n_lookup_drafted_ += n_drafted; n_lookup_accepted_ += n_accepted; }
+		uint64_t get_n_lookup_drafted() const { return n_lookup_drafted_; }
+		uint64_t get_n_lookup_accepted() const { return n_lookup_accepted_; }
+
+		void touch() { last_used_ = std::chrono::steady_clock::now().time_since_epoch().count(); }
+		int64_t get_last_used() const { return last_used_; }
 	private:
 		struct ModelDeleter {
 			void operator()(llama_model* model) const;
@@ -45,6 +95,24 @@ namespace llama_server::internal {
 
 		std::unique_ptr<llama_model, ModelDeleter> model_;
 		std::unique_ptr<mtmd_context, MtmdDeleter> mtmd_ = nullptr;
+		std::unique_ptr<Templater> templater_;
+		std::unique_ptr<GrammarCache> grammar_cache_;
+		std::unique_ptr<PieceTable> pieces_;
+		std::unique_ptr<TokenCache> token_cache_;
+		std::unique_ptr<MediaCache> media_cache_;
+		std::unique_ptr<EmbeddingCache> embedding_cache_;
+		std::unique_ptr<MediaEncoder> media_encoder_;	// last, its workers use the members above
+
+		size_t mtmd_bytes_ = 0;
+		double warmup_ms_ = 0;
+		bool warmed_up_ = false;
+		std::atomic<size_t> context_bytes_ = 0;
+		std::atomic<size_t> n_sessions_ = 0;
+		std::atomic<int64_t> last_used_ = 0;
+		std::atomic<uint64_t> n_drafted_ = 0;
+		std::atomic<uint64_t> n_accepted_ = 0;
+		std::atomic<uint64_t> n_lookup_drafted_ = 0;
+		std::atomic<uint64_t> n_lookup_accepted_ = 0;
 	};
 
 }
\ No newline at end of file
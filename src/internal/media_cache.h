@@ -0,0 +1,53 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "id_chunk.h"
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace llama_server::internal {
+
+	// Model-level LRU of tokenized media, keyed by a hash of the media bytes and shared by all sessions.
+	// Evicted chunks stay alive as long as a session still holds them.
+	class MediaCache {
+	public:
+		explicit MediaCache(size_t byte_budget);
+		~MediaCache();
+
+		MediaCache(const MediaCache&) = delete;
+		MediaCache& operator=(const MediaCache&) = delete;
+
+		static std::string make_id(std::string_view bytes);
+
+		IDChunksPtr find(std::string_view id);
+		// n_bytes is the memory held by the preprocessed media.
+		void insert(IDChunksPtr chunks, size_t n_bytes);
+
+		uint64_t get_hits() const { return n_hits_; }
+		uint64_t get_misses() const { return n_misses_; }
+		size_t get_bytes() const;
+	private:
+		struct Entry {
+			IDChunksPtr chunks;
+			size_t n_bytes;
+		};
+
+		size_t byte_budget_;
+
+		mutable std::mutex mutex_;
+		std::list<Entry> entries_;		// most recently used first
+		std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;	// views the id of each entry
+		size_t n_bytes_ = 0;
+
+		std::atomic<uint64_t> n_hits_ = 0;
+		std::atomic<uint64_t> n_misses_ = 0;
+
+		void erase(std::list<Entry>::iterator it);
+	};
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "llama_inputs.h"
+#include "id_chunk.h"
+#include "tokenizer.h"
+#include "utils.h"
+#include "embedding_cache.h"
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+namespace llama_server::internal {
+
+	class LlamaModel;
+
+	// In-memory media identified by content, the bytes are shared with the caller's Media.
+	struct MediaBuffer {
+		std::string id;
+		std::shared_ptr<const std::string> data;
+		uint32_t width = 0;
+		uint32_t height = 0;
+	};
+
+	// Model-level media pipeline shared by all sessions: files are decoded and preprocessed by a worker pool,
+	// the vision/audio encoder runs on one thread of its own so prefill can decode text meanwhile.
+	class MediaEncoder {
+	public:
+		explicit MediaEncoder(const LlamaModel& model);
+		~MediaEncoder();
+
+		MediaEncoder(const MediaEncoder&) = delete;
+		MediaEncoder& operator=(const MediaEncoder&) = delete;
+
+		// Decodes, preprocesses and tokenizes a media file, or takes it from the model's media cache.
+		std::future<IDChunksPtr> load(std::string_view path);
+		// Same as above for media passed in memory.
+		std::future<IDChunksPtr> load(MediaBuffer buffer);
+		// Encodes the media chunks of chunks, or takes them from the model's embedding cache.
+		// Sessions asking for the same media while it is encoded share the result.
+		std::shared_future<MediaEmbeddingsPtr> encode(IDChunksPtr chunks);
+
+		// Hashes the content of media, throws LlamaException if raw pixels do not match the dimensions.
+		static MediaBuffer make_buffer(Media media);
+	private:
+		const LlamaModel& model_;
+		Tokenizer tokenizer_;
+
+		std::mutex mutex_;
+		std::unordered_map<std::string, std::shared_future<MediaEmbeddingsPtr>> in_flight_;
+
+		// Declared last, their workers must stop before the members they use are gone.
+		ThreadPool preprocess_pool_;
+		ThreadPool encode_pool_;
+
+		IDChunksPtr load_sync(const MediaBuffer& buffer, std::string_view name);
+		MediaEmbeddingsPtr encode_sync(const IDChunks& chunks);
+	};
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "llama.h"
+
+#include <vector>
+#include <string>
+#include <string_view>
+
+namespace llama_server::internal {
+
+	// Text of every token of a vocabulary, rendered once per model into one arena.
+	// Special tokens are rendered as plain text would be, i.e. control tokens are empty.
+	class PieceTable {
+	public:
+		explicit PieceTable(const llama_vocab* vocab);
+
+		PieceTable(const PieceTable&) = delete;
+		PieceTable& operator=(const PieceTable&) = delete;
+
+		std::string_view get(llama_token token) const {
+			return std::string_view(arena_).substr(offsets_[token], offsets_[token + 1] - offsets_[token]);
+		}
+		bool contains(llama_token token) const { return token >= 0 && (size_t)token + 1 < offsets_.size(); }
+		size_t get_bytes() const { return arena_.size() + offsets_.size() * sizeof(uint32_t); }
+	private:
+		std::string arena_;
+		std::vector<uint32_t> offsets_;		// n_vocab + 1 entries, piece i is [offsets_[i], offsets_[i + 1])
+	};
+
+}
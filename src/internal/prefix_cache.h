@@ -0,0 +1,63 @@
+#pragma once
+
+#include "id_chunk.h"
+#include "llama.h"
+
+#include <memory>
+#include <vector>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+
+namespace llama_server::internal {
+
+	// Model-level radix tree over prompt prefixes, each cached prefix lives in a dedicated sequence of a shared context.
+	// One key covers one KV position: text tokens map to themselves, media chunks to one key per token.
+	// Must be used with exclusive access to the context.
+	class PrefixCache {
+	public:
+		using Key = uint64_t;
+
+		PrefixCache(std::vector<llama_seq_id> slots, size_t n_token_budget);
+		~PrefixCache();
+
+		PrefixCache(const PrefixCache&) = delete;
+		PrefixCache& operator=(const PrefixCache&) = delete;
+
+		static std::vector<Key> make_keys(std::span<IDChunksPtr const> chunks);
+		// Key of the index-th token of media chunk id.
+		static Key make_media_key(std::string_view id, size_t index);
+		// Media tokens after the first of their chunk, a media chunk is only reusable as a whole.
+		static bool is_media_continuation(Key key);
+
+		// Copies the longest cached prefix of keys into dst if it is longer than n_min, returns its length or 0.
+		size_t restore(llama_context* context, llama_seq_id dst, std::span<const Key> keys, size_t n_min);
+		// Keeps the first keys.size() positions of src in a cache slot.
+		void store(llama_context* context, llama_seq_id src, std::span<const Key> keys);
+	private:
+		struct Node {
+			std::vector<Key> edge;
+			std::unordered_map<Key, std::unique_ptr<Node>> children;
+			std::vector<size_t> holders;		// indices of slots whose prefix passes through this node
+		};
+
+		struct Slot {
+			llama_seq_id seq_id;
+			std::vector<Key> keys;
+			uint64_t last_used = 0;
+		};
+
+		Node root_;
+		std::vector<Slot> slots_;
+
+		size_t n_token_budget_;
+		size_t n_tokens_ = 0;
+		uint64_t tick_ = 0;
+
+		// Returns the slot index holding the longest prefix of keys and the length of that prefix.
+		std::pair<int32_t, size_t> lookup(std::span<const Key> keys) const;
+		void insert(size_t slot_idx);
+		void evict(llama_context* context, size_t slot_idx);
+	};
+
+}
\ No newline at end of file
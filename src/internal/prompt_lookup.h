@@ -0,0 +1,27 @@
+#pragma once
+
+#include "llama.h"
+
+#include <vector>
+#include <span>
+#include <unordered_map>
+
+namespace llama_server::internal {
+
+	// Draft-free speculation: proposes the continuation of the latest earlier occurrence of the trailing n-gram.
+	class PromptLookup {
+	public:
+		explicit PromptLookup(size_t n_gram);
+
+		// tokens only grows between calls, n-grams are indexed incrementally.
+		std::vector<llama_token> draft(std::span<const llama_token> tokens, size_t n_draft);
+	private:
+		size_t n_gram_;
+		size_t n_indexed_ = 0;		// continuations before this position are indexed
+
+		std::unordered_map<uint64_t, size_t> index_;		// n-gram hash -> position right after its latest occurrence
+
+		uint64_t hash(std::span<const llama_token> ngram) const;
+	};
+
+}
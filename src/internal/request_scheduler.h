@@ -0,0 +1,107 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "llama_configs.h"
+
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+
+namespace llama_server::internal {
+
+	class SchedulerTicket;
+
+	// The wait queue is full, the request is turned away at once.
+	class AdmissionException : public LlamaException {
+	public:
+		using LlamaException::LlamaException;
+	};
+
+	// Per-model admission control: at most max_active generations decode at once, the rest wait by priority then arrival.
+	// An active generation is asked to yield when a request of a higher priority waits.
+	class RequestScheduler : public std::enable_shared_from_this<RequestScheduler> {
+	public:
+		enum class Admission { ADMITTED, QUEUED, DROPPED };
+
+		RequestScheduler(
+			size_t max_active,
+			size_t max_queued,
+			std::chrono::milliseconds queue_timeout
+		);
+		~RequestScheduler();
+
+		RequestScheduler(const RequestScheduler&) = delete;
+		RequestScheduler& operator=(const RequestScheduler&) = delete;
+
+		// Throws AdmissionException if the queue is full.
+		std::unique_ptr<SchedulerTicket> enqueue(Priority priority);
+
+		uint64_t get_rejected() const { return n_rejected_; }
+		uint64_t get_timed_out() const { return n_timed_out_; }
+		uint64_t get_preempted() const { return n_preempted_; }
+	private:
+		friend class SchedulerTicket;
+
+		enum class State { QUEUED, ACTIVE, DONE };
+
+		struct Entry {
+			Priority priority;
+			uint64_t order;
+			std::chrono::steady_clock::time_point queued_at;
+			State state = State::QUEUED;
+			bool yield_requested = false;
+			bool preempted = false;
+		};
+
+		size_t max_active_;
+		size_t max_queued_;
+		std::chrono::milliseconds queue_timeout_;
+
+		std::mutex mutex_;
+		std::condition_variable admitted_cv_;
+		std::vector<std::shared_ptr<Entry>> queued_;
+		std::vector<std::shared_ptr<Entry>> active_;
+		uint64_t next_order_ = 0;
+
+		std::atomic<uint64_t> n_rejected_ = 0;
+		std::atomic<uint64_t> n_timed_out_ = 0;
+		std::atomic<uint64_t> n_preempted_ = 0;
+
+		// Must hold mutex_. schedule also drops queued entries past queue_timeout, whether their owner polls them or not.
+		Admission check(Entry& entry, const std::function<bool()>& abort_check);
+		void remove(Entry& entry);
+		void schedule();
+	};
+
+	// A place in the scheduler, released on destruction.
+	class SchedulerTicket {
+	public:
+		~SchedulerTicket();
+
+		SchedulerTicket(const SchedulerTicket&) = delete;
+		SchedulerTicket& operator=(const SchedulerTicket&) = delete;
+
+		using Admission = RequestScheduler::Admission;
+
+		// Blocks until admitted, dropped on queue timeout or when abort_check returns true.
+		Admission wait(const std::function<bool()>& abort_check);
+		Admission poll(const std::function<bool()>& abort_check);
+
+		bool should_yield() const;
+		// Gives the slot back and queues again, keeping the original arrival order.
+		void yield();
+	private:
+		friend class RequestScheduler;
+
+		SchedulerTicket(std::shared_ptr<RequestScheduler> scheduler, std::shared_ptr<RequestScheduler::Entry> entry)
+			: scheduler_(std::move(scheduler)), entry_(std::move(entry)) {}
+
+		std::shared_ptr<RequestScheduler> scheduler_;
+		std::shared_ptr<RequestScheduler::Entry> entry_;
+	};
+
+}
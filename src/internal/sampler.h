@@ -7,6 +7,8 @@
 
 #include <memory>
 #include <vector>
+#include <random>
+#include <string>
 
 struct common_chat_params;
 
@@ -25,19 +27,44 @@ namespace llama_server::internal {
 		);
 
 		llama_token apply();
+		llama_token apply(const float* logits);
+
+		// Accepts up to n_max tokens the grammar forces next and returns them, empty without a grammar.
+		std::vector<llama_token> jump_forward(size_t n_max);
 	private:
 		struct SamplerDeleter {
 			void operator()(llama_sampler* sampler) const;
 		};
 		using SamplerPtr = std::unique_ptr<llama_sampler, SamplerDeleter>;
 
+		// Configurations the fused kernels can sample without building the full candidate array.
+		enum class FastPath { NONE, GREEDY, TOP_K };
+
 		SamplerPtr ptr_ = nullptr;
+		SamplerPtr grammar_ = nullptr;
+
+		FastPath fast_path_ = FastPath::NONE;
+		bool check_first_ = false;	// a rejected draw redrawn under the mask has the masked distribution
+		float temperature_ = 0.0f;
+		float top_p_ = 1.0f;
+		size_t top_k_ = 0;
+		std::mt19937 rng_;
 
 		const LlamaContext& context_;
 
 		std::vector<llama_token_data> candidates_buffer_;
+		std::vector<llama_token_data> top_k_buffer_;
 
-		static llama_sampler* get_grammar_sampler(const Grammar& grammar, const llama_vocab* vocab);
+		// Draws from the chain without the grammar.
+		llama_token sample(const float* logits);
+		// Masks the whole vocabulary with the grammar, then draws from the chain.
+		llama_token sample_constrained(const float* logits);
+		bool is_grammar_valid(llama_token token, float logit);
+		// The token the grammar allows alone, or the retokenized text all allowed tokens start with. Empty if nothing is forced.
+		std::vector<llama_token> get_forced_tokens();
+		// Candidates for the whole vocabulary, all with a zero logit when logits is null.
+		llama_token_data_array fill_candidates(const float* logits);
+		static llama_token get_selected(const llama_token_data_array& data_array);
 	};
 
 }
\ No newline at end of file
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "llama.h"
+
+#include <vector>
+#include <span>
+#include <random>
+
+namespace llama_server::internal::sampling {
+
+	// Index of the largest logit, the first one on ties.
+	llama_token argmax(const float* logits, size_t n_vocab);
+
+	// The k largest logits in descending order, without touching the rest of the vocabulary.
+	void top_k(const float* logits, size_t n_vocab, size_t k, std::vector<llama_token_data>& out);
+
+	// Softmax with temperature over candidates sorted in descending order, keeps the smallest prefix reaching top_p
+	// (at least min_keep) and draws one token from it.
+	llama_token sample_top_p(
+		std::span<llama_token_data> candidates,
+		float temperature,
+		float top_p,
+		size_t min_keep,
+		std::mt19937& rng
+	);
+
+}
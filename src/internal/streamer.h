@@ -1,19 +1,42 @@
 #pragma once
 
+#include <array>
+#include <vector>
 #include <string>
 #include <string_view>
 #include <functional>
 
 namespace llama_server::internal {
 
+	// Passes generated text on once it is valid UTF-8, and ends the stream at the first stop string.
+	// Stop strings are matched with an Aho-Corasick automaton across token boundaries.
 	class Streamer {
 	public:
 		Streamer();
 		~Streamer() = default;
 
 		using StreamCallback = std::function<bool(std::string&&)>;
+
+		// Builds the automaton for a new generation, no stop strings disables matching.
+		void set_stop(const std::vector<std::string>& stop);
+
+		// Consumes buffer once it ends on a complete character. A tail which may begin a stop string is held back.
+		// Returns false if callback does, or if a stop string completed: the text up to its end was the last one passed.
 		bool process(std::string& buffer, StreamCallback callback);
+		// Passes the held back tail when generation ends without a stop string.
+		bool flush(StreamCallback callback);
 	private:
+		struct Node {
+			std::array<int32_t, 256> next;
+			int32_t fail = 0;
+			uint32_t depth = 0;		// length of the matched prefix, held back until it completes or breaks
+			bool terminal = false;	// a stop string ends here or at a suffix of it
+		};
+
+		std::vector<Node> nodes_;
+		int32_t state_ = 0;
+		std::string held_;
+
 		bool validate_utf8_end(std::string_view buffer);
 	};
 
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "llama_exception.h"
+#include "llama.h"
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <unordered_map>
+
+namespace llama_server::internal {
+
+	// Model-level LRU of tokenized texts, shared by all sessions. Short texts are not worth caching and always miss.
+	class TokenCache {
+	public:
+		explicit TokenCache(size_t byte_budget);
+		~TokenCache();
+
+		TokenCache(const TokenCache&) = delete;
+		TokenCache& operator=(const TokenCache&) = delete;
+
+		std::optional<std::vector<llama_token>> find(std::string_view text, bool add_special, bool parse_special);
+		void insert(std::string_view text, bool add_special, bool parse_special, const std::vector<llama_token>& tokens);
+
+		uint64_t get_hits() const { return n_hits_; }
+		uint64_t get_misses() const { return n_misses_; }
+		size_t get_bytes() const;
+	private:
+		struct Entry {
+			uint64_t key;
+			std::string text;
+			std::vector<llama_token> tokens;
+		};
+
+		size_t byte_budget_;
+
+		mutable std::mutex mutex_;
+		std::list<Entry> entries_;		// most recently used first
+		std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+		size_t n_bytes_ = 0;
+
+		std::atomic<uint64_t> n_hits_ = 0;
+		std::atomic<uint64_t> n_misses_ = 0;
+
+		static uint64_t make_key(std::string_view text, bool add_special, bool parse_special);
+		static size_t get_entry_bytes(const Entry& entry);
+		void erase(std::list<Entry>::iterator it);
+	};
+
+}
@@ -29,6 +29,8 @@ namespace llama_server::internal {
 			llama_token token,
 			bool add_special = false
 		) const;
+		// Text of token from the model's piece table, valid as long as the model.
+		std::string_view get_piece(llama_token token) const;
 
 		mtmd::input_chunks_ptr mtmd_tokenize(
 			std::string_view text,
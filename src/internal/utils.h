@@ -1,6 +1,18 @@
 #pragma once
 
+#include "llama_exception.h"
+
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <condition_variable>
 
 namespace llama_server::internal {
 
@@ -39,4 +51,63 @@ namespace llama_server::internal {
 		std::function<void(TOwner& owner, TBorrower& borrower)> return_func_ = nullptr;
 	};
 
+	// Fixed number of workers running submitted tasks in FIFO order.
+	class ThreadPool {
+	public:
+		explicit ThreadPool(size_t n_threads);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		template <typename F>
+		std::future<std::invoke_result_t<F>> submit(F&& fn) {
+			using Result = std::invoke_result_t<F>;
+
+			auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(fn));
+			std::future<Result> result = task->get_future();
+			{
+				std::lock_guard lock(mutex_);
+				if (stop_) throw LlamaException("ThreadPool is stopped.");
+				tasks_.emplace([task] { (*task)(); });
+			}
+			cv_.notify_one();
+
+			return result;
+		}
+	private:
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		std::queue<std::function<void()>> tasks_;
+		bool stop_ = false;
+
+		std::vector<std::thread> workers_;
+	};
+
+	// Reads the whole file once so later reads and mmap page faults hit the OS page cache.
+	void prefetch_file(std::string_view path);
+
+	// Whole content of a binary file, throws LlamaException if it cannot be read.
+	std::string read_file(std::string_view path);
+
+	// Read-only memory map of a whole file, throws LlamaException if it cannot be mapped.
+	class MappedFile {
+	public:
+		explicit MappedFile(std::string_view path);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const uint8_t* data() const { return data_; }
+		size_t size() const { return size_; }
+	private:
+		const uint8_t* data_ = nullptr;
+		size_t size_ = 0;
+#ifdef _WIN32
+		void* file_ = nullptr;
+		void* mapping_ = nullptr;
+#endif
+	};
+
 }
\ No newline at end of file
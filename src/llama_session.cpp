@@ -5,12 +5,17 @@
 #include "id_chunk.h"
 #include "llama_model.h"
 #include "llama_context.h"
+#include "batch_engine.h"
+#include "context_pool.h"
 #include "input_encoder.h"
 #include "kv_scheduler.h"
 #include "tokenizer.h"
 #include "templater.h"
 #include "sampler.h"
 #include "streamer.h"
+#include "drafter.h"
+#include "generator.h"
+#include "request_scheduler.h"
 #include "llama.h"
 
 #include <format>
@@ -22,7 +27,7 @@ namespace llama_server {
 	LlamaSession::LlamaSession(
 		ContextConfig context_config,
 		std::shared_ptr<LlamaModel> model
-	) {
+	) : context_config_(context_config) {
 		llama_context_params llm_context_params = llama_context_default_params();
 		llm_context_params.n_ctx = context_config.n_ctx;
 		llm_context_params.n_batch = context_config.n_batch;
@@ -30,17 +35,55 @@ namespace llama_server {
 
 		context_ = std::make_unique<LlamaContext>(llm_context_params, model);
 
+		init_components();
+	}
+
+	LlamaSession::LlamaSession(
+		ContextConfig context_config,
+		std::shared_ptr<BatchEngine> engine
+	) : context_config_(context_config) {
+		context_ = std::make_unique<LlamaContext>(std::move(engine), context_config.n_ctx);
+
+		init_components();
+	}
+
+	LlamaSession::LlamaSession(
+		ContextConfig context_config,
+		std::shared_ptr<ContextPool> context_pool
+	) : context_config_(context_config), context_pool_(std::move(context_pool)) {
+		context_ = context_pool_->acquire(context_config_);
+
+		init_components();
+	}
+
+	void LlamaSession::init_components() {
+		model_lease_ = context_->get_model().lease_session();
+
 		tokenizer_ = std::make_unique<Tokenizer>(context_->get_model());
-		templater_ = std::make_unique<Templater>(context_->get_model());
 
-		input_encoder_ = std::make_unique<InputEncoder>(*context_, *templater_, *tokenizer_, TokenEstimateStrategy(16));
-		kv_scheduler_ = std::make_unique<KVScheduler>(*context_);
+		input_encoder_ = std::make_unique<InputEncoder>(*context_, context_->get_model().get_templater(), *tokenizer_, TokenEstimateStrategy(16));
+		kv_scheduler_ = std::make_unique<KVScheduler>(*context_, context_config_.n_cache_reuse);
 
 		sampler_ = std::make_unique<Sampler>(*context_);
 		streamer_ = std::make_unique<Streamer>();
+
+		generator_ = std::make_unique<Generator>(*context_, *sampler_, *tokenizer_, *streamer_);
 	}
 
-	LlamaSession::~LlamaSession() { return; }
+	LlamaSession::~LlamaSession() {
+		if (!context_pool_ || !context_) return;
+
+		// Components borrow the context, drop them before handing it back.
+		generator_.reset();
+		drafter_.reset();
+		streamer_.reset();
+		sampler_.reset();
+		kv_scheduler_.reset();
+		input_encoder_.reset();
+		tokenizer_.reset();
+
+		context_pool_->release(context_config_, std::move(context_));
+	}
 
 	LlamaSession::LlamaSession(LlamaSession&&) noexcept = default;
 	LlamaSession& LlamaSession::operator=(LlamaSession&&) noexcept = default;
@@ -51,12 +94,31 @@ namespace llama_server {
 		std::vector<Tool> tools,
 		const GenConfig& gen_config
 	) {
+		TokenStream stream = generate_stream(std::move(head_msgs), std::move(tail_msgs), std::move(tools), gen_config);
+
+		while (auto piece = stream.next()) {
+			if (!gen_config.output_callback(std::move(*piece))) {
+				stream.stop();
+				break;
+			}
+		}
+	}
+
+	TokenStream LlamaSession::generate_stream(
+		std::vector<Message> head_msgs,
+		std::vector<Message> tail_msgs,
+		std::vector<Tool> tools,
+		const GenConfig& gen_config
+	) {
+		generator_->stop();
+		TokenStream stream(generator_.get());
+
 		// Pre-checks
 		size_t max_tokens = gen_config.max_tokens;
 
 		if (gen_config.max_tokens == 0) {
 			log_warn("Max tokens is set to 0, nothing to generate.");
-			return;
+			return stream;
 		}
 		if (gen_config.max_tokens > context_->get_n_ctx()) {
 			log_warn("Max tokens is greater than context size, setting to context size. Note: all memory will be pruned.");
@@ -65,18 +127,26 @@ namespace llama_server {
 
 		// Translate Message & Tool wrapper
 		std::vector<common_chat_msg> llama_head_msgs;
-		for (auto& msg : head_msgs) {
-			llama_head_msgs.emplace_back(common_chat_msg{
-				.role = std::move(msg.role),
-				.content = std::move(msg.content)
-			});
-		}
 		std::vector<common_chat_msg> llama_tail_msgs;
-		for (auto& msg : tail_msgs) {
-			llama_tail_msgs.emplace_back(common_chat_msg{
-				.role = std::move(msg.role),
-				.content = std::move(msg.content)
-			});
+		input_encoder_->clear_media();
+		try {
+			for (auto& msg : head_msgs) {
+				llama_head_msgs.emplace_back(common_chat_msg{
+					.role = std::move(msg.role),
+					.content = input_encoder_->bind_media(std::move(msg.content), std::move(msg.media))
+				});
+			}
+			for (auto& msg : tail_msgs) {
+				llama_tail_msgs.emplace_back(common_chat_msg{
+					.role = std::move(msg.role),
+					.content = input_encoder_->bind_media(std::move(msg.content), std::move(msg.media))
+				});
+			}
+		}
+		catch (const LlamaException& e) {
+			log_error(e.what());
+			input_encoder_->clear_media();
+			return stream;
 		}
 		std::vector<common_chat_tool> llama_tools;
 		for (auto& tool : tools) {
@@ -87,66 +157,118 @@ namespace llama_server {
 			});
 		}
 
+		// Checked inside llama_decode, so a long prefill stops within one ubatch.
+		context_->set_abort_check([cancellation = gen_config.cancellation, deadline = gen_config.deadline] {
+			return cancellation.is_cancelled()
+				|| (deadline != std::chrono::steady_clock::time_point{} && std::chrono::steady_clock::now() >= deadline);
+		});
+
 		// Prune and tokenize
 		std::vector<IDChunksPtr> chunks;
 		try { chunks = (*input_encoder_)(std::move(llama_head_msgs), std::move(llama_tail_msgs), std::move(llama_tools), max_tokens); }
 		catch (const LlamaException& e) {
 			log_error(e.what());
-			return;
-		}
-
-		// Prefill
-		try { kv_scheduler_->prefill_mtmd_cache(chunks); }
-		catch (const LlamaException& e) {
-			log_error(e.what());
-			return;
+			return stream;
 		}
 
 		common_chat_params chat_params = input_encoder_->get_chat_params_cache();
-		log_info(std::format("\n{}", chat_params.prompt));
-
-		{
-			Grammar auto_grammar = GrammarConverter::normalize(chat_params);
-			sampler_->set(gen_config, auto_grammar);
-		}
-
-		llama_token next_token = sampler_->apply();
-		if (llama_vocab_is_eog(context_->get_vocab(), next_token)) {
-			log_info("\nEnd of generation");
-			return;
-		}
-
-		std::string buffer = tokenizer_->detokenize(next_token);
-		if (!streamer_->process(buffer, gen_config.output_callback)) return;
 
-		// Generation loop
-		size_t n_generated = 1;
-		while (n_generated < max_tokens) {
-			try {
-				context_->step(next_token);
+		// The session may be moved while the stream is queued, the components it owns stay where they are.
+		auto launch = [
+			kv_scheduler = kv_scheduler_.get(), sampler = sampler_.get(), generator = generator_.get(), drafter = drafter_.get(),
+			chunks = std::move(chunks), chat_params = std::move(chat_params), gen_config, max_tokens
+		](std::unique_ptr<SchedulerTicket> ticket) mutable {
+			// Prefill
+			try { kv_scheduler->prefill_mtmd_cache(chunks); }
+			catch (const DecodeAbortedException&) {
+				log_info("Generation cancelled during prefill");
+				return;
 			}
 			catch (const LlamaException& e) {
 				log_error(e.what());
 				return;
 			}
 
-			if (llama_vocab_is_eog(context_->get_vocab(), next_token)) {
-				log_info("\nEnd of generation");
-				break;
+			log_info(std::format("\n{}", chat_params.prompt));
+
+			{
+				Grammar auto_grammar = GrammarConverter::normalize(chat_params);
+				sampler->set(gen_config, auto_grammar);
+			}
+
+			try { generator->start(chunks, gen_config, max_tokens, drafter, std::move(ticket)); }
+			catch (const LlamaException& e) {
+				log_error(e.what());
+				generator->stop();
 			}
+		};
 
-			next_token = sampler_->apply();
-			buffer += tokenizer_->detokenize(next_token);
-			if (!streamer_->process(buffer, gen_config.output_callback)) break;
+		// Admission happens while the stream is stepped, so a thread driving many streams never blocks here.
+		if (scheduler_) {
+			std::unique_ptr<SchedulerTicket> ticket;
+			try { ticket = scheduler_->enqueue(gen_config.priority); }
+			catch (const AdmissionException& e) {
+				log_warn(e.what());
+				return stream;
+			}
 
-			n_generated++;
+			generator_->queue(std::move(ticket), std::move(launch));
+			return stream;
 		}
 
-		return;
+		launch(nullptr);
+		return stream;
 	}
 
 	void LlamaSession::set_token_estimate_strategy(TokenEstimateStrategy&& strategy) {
 		input_encoder_->set_token_estimate_strategy(std::move(strategy));
 	}
 
+	void LlamaSession::set_draft_model(std::shared_ptr<LlamaModel> draft_model) {
+		if (!Drafter::is_compatible(context_->get_model(), *draft_model)) {
+			log_warn("Draft model vocabulary differs from the target, speculative decoding disabled.");
+			return;
+		}
+
+		drafter_ = std::make_unique<Drafter>(std::move(draft_model), (uint32_t)context_->get_n_ctx());
+	}
+
+	void LlamaSession::set_scheduler(std::shared_ptr<RequestScheduler> scheduler) {
+		scheduler_ = std::move(scheduler);
+	}
+
+	void LlamaSession::save_state(std::string path) const {
+		generator_->stop();
+		kv_scheduler_->save_state(path);
+	}
+
+	void LlamaSession::load_state(std::string path) {
+		generator_->stop();
+		kv_scheduler_->load_state(path);
+	}
+
+	std::optional<std::string> TokenStream::next() {
+		while (!generator_->has_output() && !generator_->is_finished()) generator_->step(true);
+
+		if (!generator_->has_output()) return std::nullopt;
+		return generator_->pop_output();
+	}
+
+	bool TokenStream::ready() {
+		if (generator_->has_output() || generator_->is_finished()) return true;
+
+		while (generator_->step(false)) {
+			if (generator_->has_output() || generator_->is_finished()) return true;
+		}
+		return false;
+	}
+
+	bool TokenStream::finished() const {
+		return !generator_->has_output() && generator_->is_finished();
+	}
+
+	void TokenStream::stop() {
+		generator_->stop();
+	}
+
 }
\ No newline at end of file
@@ -0,0 +1,293 @@
+#include "batch_engine.h"
+#include "llama_context.h"
+#include "llama_model.h"
+#include "llama_log.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cstring>
+#include <format>
+
+namespace llama_server::internal {
+
+	// ===================================================================
+	// BatchEngine::ContextDeleter
+	// ===================================================================
+
+	void BatchEngine::ContextDeleter::operator()(llama_context* context) const { llama_free(context); }
+
+	// ===================================================================
+	// BatchEngine
+	// ===================================================================
+
+	BatchEngine::BatchEngine(
+		const llama_context_params& params,
+		std::shared_ptr<LlamaModel> model,
+		uint32_t n_prefix_slots,
+		size_t n_prefix_tokens
+	) {
+		model_ = model;
+
+		context_ = std::unique_ptr<llama_context, ContextDeleter>(
+			llama_init_from_model(model->get_data(), params)
+		);
+		if (!context_) {
+			throw LlamaException("Failed to create shared llama context");
+		}
+
+		const uint32_t n_seq_max = llama_n_seq_max(context_.get());
+		if (n_prefix_slots >= n_seq_max) {
+			throw LlamaException("No sequence left for sessions after reserving prefix cache slots");
+		}
+
+		// Cached prefixes may outlive the sessions they were copied from, their budget is not available to sessions.
+		n_reserved_ = n_prefix_slots > 0 ? n_prefix_tokens : 0;
+		if (n_reserved_ >= llama_n_ctx(context_.get())) {
+			throw LlamaException(std::format("Prefix cache budget of {} tokens leaves no KV for sessions in a context of {}", n_reserved_, llama_n_ctx(context_.get())));
+		}
+
+		batch_ = llama_batch_init(llama_n_batch(context_.get()), 0, 1);
+
+		kv_bytes_ = model_->estimate_kv_bytes(llama_n_ctx(context_.get()));
+		model_->add_context_bytes(kv_bytes_);
+
+		seq_n_ctx_ = std::vector<uint32_t>(n_seq_max - n_prefix_slots, 0);
+
+		if (n_prefix_slots > 0) {
+			std::vector<llama_seq_id> slots;
+			for (uint32_t i = n_seq_max - n_prefix_slots; i < n_seq_max; i++) slots.emplace_back((llama_seq_id)i);
+			prefix_cache_ = std::make_unique<PrefixCache>(std::move(slots), n_prefix_tokens);
+		}
+
+		worker_ = std::thread([this] { loop(); });
+	}
+
+	BatchEngine::~BatchEngine() {
+		{
+			std::lock_guard lock(queue_mutex_);
+			stop_ = true;
+		}
+		queue_cv_.notify_all();
+
+		if (worker_.joinable()) worker_.join();
+
+		llama_batch_free(batch_);
+		model_->remove_context_bytes(kv_bytes_);
+	}
+
+	size_t BatchEngine::get_n_ctx() const { return llama_n_ctx(context_.get()); }
+
+	size_t BatchEngine::get_n_vocab() const { return llama_vocab_n_tokens(model_->get_vocab()); }
+
+	llama_seq_id BatchEngine::acquire_seq(uint32_t n_ctx) {
+		std::lock_guard lock(queue_mutex_);
+
+		auto it = std::find(seq_n_ctx_.begin(), seq_n_ctx_.end(), 0);
+		if (it == seq_n_ctx_.end()) {
+			throw LlamaException(std::format("BatchEngine: All {} sequences are in use.", seq_n_ctx_.size()));
+		}
+		if (n_reserved_ + n_ctx > get_n_ctx()) {
+			throw LlamaException(std::format(
+				"BatchEngine: A session of {} tokens does not fit, {} of {} KV cells are reserved.", n_ctx, n_reserved_, get_n_ctx()
+			));
+		}
+
+		*it = n_ctx;
+		n_reserved_ += n_ctx;
+		return (llama_seq_id)(it - seq_n_ctx_.begin());
+	}
+
+	void BatchEngine::release_seq(llama_seq_id seq_id) {
+		exclusive([seq_id](llama_context* context) {
+			llama_memory_seq_rm(llama_get_memory(context), seq_id, -1, -1);
+		});
+
+		std::lock_guard lock(queue_mutex_);
+		n_reserved_ -= seq_n_ctx_[seq_id];
+		seq_n_ctx_[seq_id] = 0;
+	}
+
+	size_t BatchEngine::restore_prefix(llama_seq_id seq_id, std::span<const PrefixCache::Key> keys, size_t n_min) {
+		if (!prefix_cache_) return 0;
+
+		return exclusive([&](llama_context* context) {
+			return prefix_cache_->restore(context, seq_id, keys, n_min);
+		});
+	}
+
+	void BatchEngine::store_prefix(llama_seq_id seq_id, std::span<const PrefixCache::Key> keys) {
+		if (!prefix_cache_) return;
+
+		exclusive([&](llama_context* context) {
+			prefix_cache_->store(context, seq_id, keys);
+		});
+	}
+
+	void BatchEngine::decode(
+		llama_seq_id seq_id,
+		std::span<const llama_token> tokens,
+		Logits logits,
+		float* logits_out,
+		std::function<bool()> abort_check
+	) {
+		submit(seq_id, tokens, logits, logits_out, std::move(abort_check)).get();
+	}
+
+	std::future<void> BatchEngine::submit(
+		llama_seq_id seq_id,
+		std::span<const llama_token> tokens,
+		Logits logits,
+		float* logits_out,
+		std::function<bool()> abort_check
+	) {
+		auto request = std::make_shared<DecodeRequest>(DecodeRequest{
+			.seq_id = seq_id,
+			.tokens = tokens,
+			.logits = logits,
+			.logits_out = logits_out,
+			.abort_check = std::move(abort_check)
+		});
+		std::future<void> done = request->done.get_future();
+
+		if (tokens.empty()) {
+			request->done.set_value();
+			return done;
+		}
+
+		{
+			std::lock_guard lock(queue_mutex_);
+			if (stop_) throw LlamaException("BatchEngine is stopped.");
+			pending_.emplace_back(std::move(request));
+		}
+		queue_cv_.notify_one();
+
+		return done;
+	}
+
+	void BatchEngine::loop() {
+		const int32_t n_batch = llama_n_batch(context_.get());
+		const size_t n_vocab = get_n_vocab();
+
+		struct Scheduled {
+			DecodeRequest* request;
+			size_t n_take;
+			int32_t last_index;
+		};
+
+		std::vector<std::shared_ptr<DecodeRequest>> active;
+		std::vector<Scheduled> scheduled;
+
+		while (true) {
+			{
+				std::unique_lock lock(queue_mutex_);
+				queue_cv_.wait(lock, [this, &active] { return stop_ || !pending_.empty() || !active.empty(); });
+
+				active.insert(active.end(), pending_.begin(), pending_.end());
+				pending_.clear();
+
+				if (stop_) {
+					for (auto& request : active) {
+						request->done.set_exception(std::make_exception_ptr(LlamaException("BatchEngine is stopped.")));
+					}
+					return;
+				}
+			}
+
+			// Aborted requests leave the KV with what they decoded so far.
+			std::erase_if(active, [](const std::shared_ptr<DecodeRequest>& request) {
+				if (!request->abort_check || !request->abort_check()) return false;
+				request->done.set_exception(std::make_exception_ptr(DecodeAbortedException("Decoding Aborted.")));
+				return true;
+			});
+			if (active.empty()) continue;
+
+			// Sessions that are generating go first, so a long prefill cannot stall them.
+			std::stable_partition(active.begin(), active.end(), [](const std::shared_ptr<DecodeRequest>& request) {
+				return request->tokens.size() - request->n_done == 1;
+			});
+
+			std::exception_ptr error = nullptr;
+			std::vector<DecodeRequest*> rejected;
+
+			{
+				std::lock_guard context_lock(context_mutex_);
+				llama_memory_t kv_mem = llama_get_memory(context_.get());
+
+				while (true) {
+					scheduled.clear();
+					batch_.n_tokens = 0;
+					for (auto& request : active) {
+						if (batch_.n_tokens == n_batch) break;
+						if (std::ranges::find(rejected, request.get()) != rejected.end()) continue;
+
+						if (request->pos < 0) request->pos = llama_memory_seq_pos_max(kv_mem, request->seq_id) + 1;
+
+						size_t n_take = std::min(request->tokens.size() - request->n_done, (size_t)(n_batch - batch_.n_tokens));
+						for (size_t i = 0; i < n_take; i++) {
+							int32_t idx = batch_.n_tokens++;
+							batch_.token[idx] = request->tokens[request->n_done + i];
+							batch_.pos[idx] = request->pos + (llama_pos)i;
+							batch_.n_seq_id[idx] = 1;
+							batch_.seq_id[idx][0] = request->seq_id;
+							batch_.logits[idx] = request->logits == Logits::ALL
+								|| (request->logits == Logits::LAST && request->n_done + i + 1 == request->tokens.size());
+						}
+
+						scheduled.emplace_back(Scheduled{ request.get(), n_take, batch_.n_tokens - 1 });
+					}
+
+					int32_t ret = llama_decode(context_.get(), batch_);
+					try { LlamaContext::check_decode(ret); }
+					catch (const LlamaException&) { error = std::current_exception(); }
+
+					// Out of KV cells: the sequence holding the most positions fails alone and the others are decoded again.
+					// A failed decode leaves the KV as it was before the batch.
+					if (ret == 1 && scheduled.size() > 1) {
+						auto largest = std::ranges::max_element(scheduled, {}, [](const Scheduled& entry) {
+							return entry.request->pos + (llama_pos)entry.n_take;
+						});
+						largest->request->done.set_exception(error);
+						rejected.emplace_back(largest->request);
+						error = nullptr;
+						continue;
+					}
+					break;
+				}
+
+				if (!error) {
+					for (auto& [request, n_take, last_index] : scheduled) {
+						if (request->logits == Logits::ALL) {
+							for (size_t i = 0; i < n_take; i++) {
+								std::memcpy(
+									request->logits_out + (request->n_done + i) * n_vocab,
+									llama_get_logits_ith(context_.get(), last_index - (int32_t)(n_take - 1 - i)),
+									n_vocab * sizeof(float)
+								);
+							}
+						}
+
+						request->n_done += n_take;
+						request->pos += (llama_pos)n_take;
+
+						if (request->n_done == request->tokens.size() && request->logits == Logits::LAST) {
+							std::memcpy(request->logits_out, llama_get_logits_ith(context_.get(), last_index), n_vocab * sizeof(float));
+						}
+					}
+				}
+			}
+
+			std::erase_if(active, [&rejected](const std::shared_ptr<DecodeRequest>& request) {
+				return std::ranges::find(rejected, request.get()) != rejected.end();
+			});
+
+			for (auto& [request, n_take, last_index] : scheduled) {
+				if (error) request->done.set_exception(error);
+				else if (request->n_done == request->tokens.size()) request->done.set_value();
+				else continue;
+
+				std::erase_if(active, [request](const std::shared_ptr<DecodeRequest>& other) { return other.get() == request; });
+			}
+		}
+	}
+
+}
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "llama_context.h"
 #include "llama_model.h"
+#include "batch_engine.h"
+#include "media_encoder.h"
 #include "llama_log.h"
 #include "llama.h"
 #include "mtmd-helper.h"
@@ -34,27 +36,98 @@ namespace llama_server::internal {
 		}
 
 		prefill_mask_ = std::vector<int8_t>(llama_n_batch(context_.get()), 0);
+
+		llama_set_abort_callback(context_.get(), [](void* data) {
+			auto& abort_check = *static_cast<std::function<bool()>*>(data);
+			return abort_check && abort_check();
+		}, abort_check_.get());
+
+		kv_bytes_ = model_->estimate_kv_bytes(llama_n_ctx(context_.get()));
+		model_->add_context_bytes(kv_bytes_);
 	}
 
-	LlamaContext::~LlamaContext() {}
+	LlamaContext::LlamaContext(
+		std::shared_ptr<BatchEngine> engine,
+		uint32_t n_ctx
+	) {
+		model_ = engine->get_model_ptr();
+		engine_ = engine;
+
+		n_ctx_ = (n_ctx == 0 || n_ctx > engine_->get_n_ctx()) ? engine_->get_n_ctx() : n_ctx;
+		seq_id_ = engine_->acquire_seq(n_ctx_);
+		logits_ = std::vector<float>(engine_->get_n_vocab(), 0.0f);
+	}
+
+	LlamaContext::~LlamaContext() {
+		if (engine_) engine_->release_seq(seq_id_);
+		if (model_ && kv_bytes_ > 0) model_->remove_context_bytes(kv_bytes_);
+	}
 
 	LlamaContext::LlamaContext(LlamaContext&& other) noexcept = default;
 
 	LlamaContext& LlamaContext::operator=(LlamaContext&& other) noexcept = default;
 
+	template <typename F>
+	decltype(auto) LlamaContext::with_context(F&& fn) const {
+		if (engine_) return engine_->exclusive(std::forward<F>(fn));
+		return fn(context_.get());
+	}
+
 	bool LlamaContext::is_mtmd() const { return model_->get_mtmd() != nullptr; }
 
+	llama_context* LlamaContext::get_data() const { return engine_ ? engine_->get_data() : context_.get(); }
+
 	const llama_vocab* LlamaContext::get_vocab() const { return model_->get_vocab(); }
 
-	size_t LlamaContext::get_n_ctx() const { return llama_n_ctx(context_.get()); }
+	const float* LlamaContext::get_logits() const {
+		if (engine_) return logits_.data();
+		return llama_get_logits_ith(context_.get(), -1);
+	}
+
+	const float* LlamaContext::get_logits(size_t i) const {
+		if (engine_) return batch_logits_.data() + i * get_n_vocab();
+		return llama_get_logits_ith(context_.get(), (int32_t)i);
+	}
+
+	size_t LlamaContext::get_n_ctx() const { return engine_ ? n_ctx_ : llama_n_ctx(context_.get()); }
 
 	size_t LlamaContext::get_n_vocab() const { return llama_vocab_n_tokens(model_->get_vocab()); }
 
-	size_t LlamaContext::get_used_memory(llama_seq_id seq_id) const {
-		return llama_memory_seq_pos_max(llama_get_memory(context_.get()), seq_id) + 1;
+	size_t LlamaContext::get_used_memory() const {
+		return with_context([this](llama_context* context) {
+			return (size_t)(llama_memory_seq_pos_max(llama_get_memory(context), seq_id_) + 1);
+		});
+	}
+
+	void LlamaContext::set_abort_check(std::function<bool()> abort_check) {
+		*abort_check_ = std::move(abort_check);
+	}
+
+	bool LlamaContext::is_abort_requested() const {
+		return *abort_check_ && (*abort_check_)();
+	}
+
+	void LlamaContext::check_decode(int32_t ret) {
+		switch (ret) {
+		case 0:
+			break;
+		case 1:
+			throw LlamaException("Decoding failed: Could not find a KV slot for the batch.");
+		case 2:
+			throw DecodeAbortedException("Decoding Aborted.");
+		case -1:
+			throw LlamaException("Decoding failed: Invalid input batch.");
+		default:
+			throw ContextGenerateDirtyException("Decoding failed: Unknown error");
+		}
 	}
 
 	void LlamaContext::text_prefill(const llama_token* tokens, size_t n_tokens, bool logits_last) {
+		if (engine_) {
+			engine_->decode(seq_id_, { tokens, n_tokens }, logits_last ? BatchEngine::Logits::LAST : BatchEngine::Logits::NONE, logits_.data(), *abort_check_);
+			return;
+		}
+
 		const int32_t n_batch = llama_n_batch(context_.get());
 
 		// It is guaranteed that text_tokens are not written by llama_decode.
@@ -80,18 +153,7 @@ namespace llama_server::internal {
 
 			prefill_mask_[n_eval - 1] = 0;
 
-			switch (ret) {
-			case 0:
-				break;
-			case 1:
-				throw LlamaException("Decoding failed: Could not find a KV slot for the batch.");
-			case 2:
-				throw ContextGenerateDirtyException("Decoding Aborted.");
-			case -1:
-				throw LlamaException("Decoding failed: Invalid input batch.");
-			default:
-				throw ContextGenerateDirtyException("Decoding failed: Unknown error");
-			}
+			check_decode(ret);
 		}
 	}
 
@@ -99,12 +161,51 @@ namespace llama_server::internal {
 		text_prefill(tokens.data(), tokens.size(), logits_last);
 	}
 
+	void LlamaContext::text_prefill_all(std::span<const llama_token> tokens) {
+		if (tokens.empty()) return;
+
+		if (engine_) {
+			batch_logits_.resize(tokens.size() * get_n_vocab());
+			engine_->decode(seq_id_, tokens, BatchEngine::Logits::ALL, batch_logits_.data(), *abort_check_);
+			return;
+		}
+
+		if (tokens.size() > llama_n_batch(context_.get())) {
+			throw LlamaException("Decoding failed: Too many tokens for one batch.");
+		}
+
+		std::fill_n(prefill_mask_.begin(), tokens.size(), 1);
+
+		const int32_t ret = llama_decode(
+			context_.get(),
+			llama_batch{
+				.n_tokens = (int32_t)tokens.size(),
+				.token = const_cast<llama_token*>(tokens.data()),
+				.embd = nullptr,
+				.pos = nullptr,
+				.n_seq_id = nullptr,
+				.seq_id = nullptr,
+				.logits = prefill_mask_.data()
+			}
+		);
+
+		std::fill_n(prefill_mask_.begin(), tokens.size(), 0);
+
+		check_decode(ret);
+	}
+
 	void LlamaContext::mtmd_prefill(std::span<IDChunksPtr const> chunks) {
 		if (chunks.size() == 0) {
 			log_info("No chunks to prefill");
 			return;
 		}
 
+		// All media are queued on the model's encoder first, so they are encoded while the chunks before them are decoded.
+		std::vector<std::shared_future<MediaEmbeddingsPtr>> embeddings(chunks.size());
+		for (size_t i = 0; i < chunks.size(); i++) {
+			if (chunks[i]->type == IMAGE || chunks[i]->type == AUDIO) embeddings[i] = model_->get_media_encoder().encode(chunks[i]);
+		}
+
 		for (size_t i = 0; i < chunks.size(); i++) {
 			bool chunk_logits_last = (i + 1) == chunks.size();
 
@@ -116,8 +217,12 @@ namespace llama_server::internal {
 				);
 			}
 			else if (chunk_type == IMAGE || chunk_type == AUDIO) {
+				MediaEmbeddingsPtr chunk_embeddings = embeddings[i].get();
+				if (is_abort_requested()) throw DecodeAbortedException("Decoding Aborted.");
+
 				eval_single_mtmd_chunks(
 					chunks[i],
+					*chunk_embeddings,
 					chunk_logits_last
 				);
 			}
@@ -131,26 +236,79 @@ namespace llama_server::internal {
 		text_prefill(&token, 1, true);
 	}
 
-	void LlamaContext::KV_cleanup(int32_t head_keep, int32_t tail_spare, llama_seq_id seq_id) {
-		llama_memory_t kv_mem = llama_get_memory(context_.get());
+	std::future<void> LlamaContext::step_async(llama_token token) {
+		if (engine_) {
+			step_token_ = token;
+			return engine_->submit(seq_id_, { &step_token_, 1 }, BatchEngine::Logits::LAST, logits_.data(), *abort_check_);
+		}
+
+		std::promise<void> done;
+		try {
+			step(token);
+			done.set_value();
+		}
+		catch (const LlamaException&) { done.set_exception(std::current_exception()); }
+		return done.get_future();
+	}
+
+	void LlamaContext::warm_up() {
+		const llama_vocab* vocab = get_vocab();
+
+		std::vector<llama_token> tokens;
+		if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) tokens.emplace_back(llama_vocab_bos(vocab));
+		if (llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) tokens.emplace_back(llama_vocab_eos(vocab));
+		if (tokens.empty()) tokens.emplace_back(0);
+
+		with_context([](llama_context* context) { llama_set_warmup(context, true); });
+
+		try { text_prefill(tokens, true); }
+		catch (const LlamaException&) {
+			with_context([](llama_context* context) { llama_set_warmup(context, false); });
+			throw;
+		}
+
+		with_context([](llama_context* context) { llama_set_warmup(context, false); });
+		KV_cleanup(0);
+	}
+
+	void LlamaContext::KV_cleanup(int32_t head_keep, int32_t tail_spare) {
+		with_context([this, head_keep, tail_spare](llama_context* context) {
+			cleanup_locked(context, head_keep, tail_spare);
+		});
+	}
+
+	void LlamaContext::KV_move(size_t src, size_t dst, size_t n_tokens) {
+		with_context([this, src, dst, n_tokens](llama_context* context) {
+			llama_memory_t kv_mem = llama_get_memory(context);
+			llama_memory_seq_rm(kv_mem, seq_id_, (llama_pos)dst, (llama_pos)src);
+			llama_memory_seq_add(kv_mem, seq_id_, (llama_pos)src, (llama_pos)(src + n_tokens), (llama_pos)dst - (llama_pos)src);
+		});
+	}
+
+	bool LlamaContext::can_shift() const {
+		return with_context([](llama_context* context) { return llama_memory_can_shift(llama_get_memory(context)); });
+	}
+
+	void LlamaContext::cleanup_locked(llama_context* context, int32_t head_keep, int32_t tail_spare) {
+		llama_memory_t kv_mem = llama_get_memory(context);
 		if (!kv_mem) {
 			throw LlamaException("Failed to get KV memory from context");
 		}
 
-		int32_t n_ctx = llama_n_ctx(context_.get());
+		int32_t n_ctx = get_n_ctx();
 
 		if (tail_spare == -1) {
-			llama_memory_seq_rm(kv_mem, seq_id, head_keep, -1);
+			llama_memory_seq_rm(kv_mem, seq_id_, head_keep, -1);
 			return;
 		}
 
 		if (head_keep + tail_spare >= n_ctx) {
 			log_warn("Prompt exceeds KV Cache.");
-			llama_memory_seq_rm(kv_mem, seq_id, head_keep, -1);
+			llama_memory_seq_rm(kv_mem, seq_id_, head_keep, -1);
 			return;
 		}
 
-		llama_pos max_pos = llama_memory_seq_pos_max(kv_mem, seq_id);
+		llama_pos max_pos = llama_memory_seq_pos_max(kv_mem, seq_id_);
 		int32_t n_past = max_pos + 1;
 
 		if (n_past + tail_spare <= n_ctx) return;
@@ -162,17 +320,48 @@ namespace llama_server::internal {
 
 		if (p1 >= n_ctx) {
 			log_warn("Too large system prompt, no memory available");
-			llama_memory_seq_rm(kv_mem, seq_id, head_keep, -1);
+			llama_memory_seq_rm(kv_mem, seq_id_, head_keep, -1);
 			return;
 		}
 
 		if (p1 >= n_past) {
-			llama_memory_seq_rm(kv_mem, seq_id, head_keep, -1);
+			llama_memory_seq_rm(kv_mem, seq_id_, head_keep, -1);
 			return;
 		}
 
-		llama_memory_seq_rm(kv_mem, seq_id, p0, p1);
-		llama_memory_seq_add(kv_mem, seq_id, p1, n_past, -(llama_pos)n_discard);
+		llama_memory_seq_rm(kv_mem, seq_id_, p0, p1);
+		llama_memory_seq_add(kv_mem, seq_id_, p1, n_past, -(llama_pos)n_discard);
+	}
+
+	std::vector<uint8_t> LlamaContext::get_state() const {
+		return with_context([this](llama_context* context) {
+			std::vector<uint8_t> state(llama_state_seq_get_size(context, seq_id_));
+			if (llama_state_seq_get_data(context, state.data(), state.size(), seq_id_) != state.size()) {
+				throw LlamaException("Failed to copy sequence state");
+			}
+			return state;
+		});
+	}
+
+	void LlamaContext::set_state(std::span<const uint8_t> state) {
+		with_context([this, state](llama_context* context) {
+			llama_memory_seq_rm(llama_get_memory(context), seq_id_, -1, -1);
+			if (llama_state_seq_set_data(context, state.data(), state.size(), seq_id_) == 0) {
+				llama_memory_seq_rm(llama_get_memory(context), seq_id_, -1, -1);
+				throw LlamaException("Failed to restore sequence state");
+			}
+		});
+	}
+
+	bool LlamaContext::has_prefix_cache() const { return engine_ && engine_->has_prefix_cache(); }
+
+	size_t LlamaContext::restore_prefix(std::span<const PrefixCache::Key> keys, size_t n_min) {
+		if (!engine_) return 0;
+		return engine_->restore_prefix(seq_id_, keys, n_min);
+	}
+
+	void LlamaContext::store_prefix(std::span<const PrefixCache::Key> keys) {
+		if (engine_) engine_->store_prefix(seq_id_, keys);
 	}
 
 	void LlamaContext::eval_single_text_chunks(
@@ -184,18 +373,54 @@ namespace llama_server::internal {
 
 	void LlamaContext::eval_single_mtmd_chunks(
 		IDChunksPtr chunks,
+		const MediaEmbeddings& embeddings,
 		bool logits_last
 	) {
-		llama_pos new_n_past; // fake variable to satisfy the API
-		if (mtmd_helper_eval_chunks(
-			model_->get_mtmd(),
-			context_.get(),
-			chunks->chunks.get(),
-			get_used_memory(),
-			0,
-			llama_n_batch(context_.get()),
-			logits_last,
-			&new_n_past)) { throw LlamaException("Multimodel decoding failed"); }
+		const size_t n_chunks = mtmd_input_chunks_size(chunks->chunks.get());
+		size_t media_idx = 0;
+
+		// mtmd reads n_tokens * n_embd floats per media chunk, whatever the span holds.
+		if (!embeddings.matches(chunks->chunks.get(), llama_model_n_embd(model_->get_data()))) {
+			throw LlamaException(std::format("Embeddings of {} do not match its media chunks", chunks->id));
+		}
+
+		for (size_t i = 0; i < n_chunks; i++) {
+			const mtmd_input_chunk* chunk = mtmd_input_chunks_get(chunks->chunks.get(), i);
+			const bool chunk_logits_last = logits_last && (i + 1) == n_chunks;
+
+			if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+				size_t n_tokens;
+				const llama_token* tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
+				text_prefill(tokens, n_tokens, chunk_logits_last);
+				continue;
+			}
+
+			// It is guaranteed that embeddings are not written by the decode.
+			float* embd = const_cast<float*>(embeddings.chunks[media_idx++].data());
+
+			// Only the embeddings decode needs the context, the encoder ran outside of it.
+			with_context([&](llama_context* context) {
+				llama_pos new_n_past; // fake variable to satisfy the API
+				if (mtmd_helper_decode_image_chunk(
+					model_->get_mtmd(),
+					context,
+					chunk,
+					embd,
+					llama_memory_seq_pos_max(llama_get_memory(context), seq_id_) + 1,
+					seq_id_,
+					llama_n_batch(context),
+					&new_n_past)) {
+					if (is_abort_requested()) throw DecodeAbortedException("Decoding Aborted.");
+					throw LlamaException("Multimodel decoding failed");
+				}
+
+				// The shared logits are overwritten by the next batch, keep our own copy.
+				if (engine_ && chunk_logits_last) {
+					const float* logits = llama_get_logits_ith(context, -1);
+					std::copy(logits, logits + logits_.size(), logits_.begin());
+				}
+			});
+		}
 	}
 
 }
\ No newline at end of file
@@ -1,11 +1,32 @@
 #include "llama_model.h"
+#include "templater.h"
+#include "grammar_cache.h"
+#include "piece_table.h"
+#include "token_cache.h"
+#include "media_cache.h"
+#include "media_encoder.h"
+#include "embedding_cache.h"
+#include "utils.h"
 #include "llama.h"
 #include "mtmd-helper.h"
 
+#include <algorithm>
+#include <filesystem>
 #include <format>
+#include <future>
 
 namespace llama_server::internal {
 
+	namespace llama_model_detail {
+
+		// Distinct grammars a model keeps compiled, e.g. one per tool set in use.
+		constexpr size_t grammar_cache_capacity = 16;
+		constexpr size_t token_cache_bytes = 16ull << 20;
+
+	}
+
+	using namespace llama_model_detail;
+
 	// ===================================================================
 	// LlamaModel::ModelDeleter
 	// ===================================================================
@@ -26,22 +47,70 @@ namespace llama_server::internal {
 		std::string_view model_path,
 		const llama_model_params& model_params,
 		std::string_view mtmd_path,
-		const mtmd_context_params& mtmd_params
+		const mtmd_context_params& mtmd_params,
+		size_t media_cache_bytes,
+		size_t embedding_cache_bytes,
+		std::string_view embedding_cache_dir
 	) {
+		// mtmd is initialized from the text model, only reading its file can overlap with the model load.
+		std::future<void> mtmd_prefetch;
+		if (!mtmd_path.empty()) {
+			mtmd_prefetch = std::async(std::launch::async, [path = std::string(mtmd_path)] { prefetch_file(path); });
+		}
+
 		model_ = std::unique_ptr<llama_model, ModelDeleter>(llama_model_load_from_file(model_path.data(), model_params));
 		if (!model_) throw LlamaException(std::format("Failed to load model from file: {}", model_path));
 
 		if (!mtmd_path.empty()) {
+			mtmd_prefetch.wait();
 			mtmd_ = std::unique_ptr<mtmd_context, MtmdDeleter>(mtmd_init_from_file(mtmd_path.data(), model_.get(), mtmd_params));
 			if (!mtmd_) throw LlamaException(std::format("Failed to load mtmd from file: {}", mtmd_path));
+
+			std::error_code ec;
+			mtmd_bytes_ = std::filesystem::file_size(mtmd_path, ec);
+			if (ec) mtmd_bytes_ = 0;
+		}
+
+		templater_ = std::make_unique<Templater>(*this);
+		grammar_cache_ = std::make_unique<GrammarCache>(get_vocab(), grammar_cache_capacity);
+		pieces_ = std::make_unique<PieceTable>(get_vocab());
+		token_cache_ = std::make_unique<TokenCache>(token_cache_bytes);
+		media_cache_ = std::make_unique<MediaCache>(media_cache_bytes);
+		if (mtmd_) {
+			// Embeddings on disk are only valid for the same projector file and image token limits.
+			std::error_code ec;
+			auto mtmd_time = std::filesystem::last_write_time(mtmd_path, ec).time_since_epoch().count();
+			std::string projector_identity = std::format("{}|{}|{}|{}|{}",
+				std::filesystem::path(mtmd_path).filename().string(), mtmd_bytes_, ec ? 0 : mtmd_time,
+				mtmd_params.image_min_tokens, mtmd_params.image_max_tokens);
+
+			embedding_cache_ = std::make_unique<EmbeddingCache>(embedding_cache_bytes, embedding_cache_dir, projector_identity);
+			media_encoder_ = std::make_unique<MediaEncoder>(*this);
 		}
+		touch();
 	}
 
 	LlamaModel::~LlamaModel() { return; }
 
-	LlamaModel::LlamaModel(LlamaModel&&) noexcept = default;
-	LlamaModel& LlamaModel::operator=(LlamaModel&&) noexcept = default;
-
 	const llama_vocab* LlamaModel::get_vocab() const { return llama_model_get_vocab(model_.get()); }
 
+	size_t LlamaModel::get_footprint() const {
+		return (size_t)llama_model_size(model_.get()) + mtmd_bytes_ + context_bytes_;
+	}
+
+	size_t LlamaModel::estimate_kv_bytes(uint32_t n_ctx) const {
+		const size_t n_layer = llama_model_n_layer(model_.get());
+		const size_t n_head = std::max(llama_model_n_head(model_.get()), 1);
+		const size_t n_embd_kv = llama_model_n_embd(model_.get()) / n_head * llama_model_n_head_kv(model_.get());
+
+		// K and V in f16.
+		return 2 * n_layer * n_ctx * n_embd_kv * sizeof(uint16_t);
+	}
+
+	std::shared_ptr<void> LlamaModel::lease_session() {
+		n_sessions_++;
+		touch();
+		return std::shared_ptr<void>(nullptr, [this](void*) { n_sessions_--; });
+	}
+
 }
\ No newline at end of file
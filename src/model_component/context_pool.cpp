@@ -0,0 +1,123 @@
+#include "context_pool.h"
+#include "llama_context.h"
+#include "llama_model.h"
+#include "llama_log.h"
+#include "llama.h"
+
+#include <format>
+
+namespace llama_server::internal {
+
+	ContextPool::ContextPool(
+		std::shared_ptr<LlamaModel> model,
+		size_t n_min,
+		size_t n_max
+	) : model_(std::move(model)), n_min_(std::min(n_min, n_max)), n_max_(n_max) {
+		refill_worker_ = std::thread([this] { refill_loop(); });
+	}
+
+	ContextPool::~ContextPool() {
+		{
+			std::lock_guard lock(mutex_);
+			stop_ = true;
+		}
+		refill_cv_.notify_all();
+
+		if (refill_worker_.joinable()) refill_worker_.join();
+	}
+
+	std::unique_ptr<LlamaContext> ContextPool::acquire(const ContextConfig& config) {
+		{
+			std::lock_guard lock(mutex_);
+
+			auto& idle = idle_[make_key(config)];
+			if (!idle.empty()) {
+				std::unique_ptr<LlamaContext> context = std::move(idle.back());
+				idle.pop_back();
+
+				if (idle.size() < n_min_) {
+					refill_queue_.emplace_back(config);
+					refill_cv_.notify_one();
+				}
+
+				n_hits_++;
+				return context;
+			}
+
+			// Keep n_min warm contexts of this config for the next burst.
+			if (n_min_ > 0) {
+				refill_queue_.emplace_back(config);
+				refill_cv_.notify_one();
+			}
+		}
+
+		n_misses_++;
+		return create(config);
+	}
+
+	void ContextPool::release(const ContextConfig& config, std::unique_ptr<LlamaContext> context) {
+		try { context->KV_cleanup(0); }
+		catch (const LlamaException& e) {
+			log_warn(std::format("ContextPool: Dropping context which cannot be cleared: {}", e.what()));
+			return;
+		}
+
+		std::unique_lock lock(mutex_);
+
+		auto& idle = idle_[make_key(config)];
+		if (idle.size() >= n_max_) {
+			lock.unlock();
+			return;
+		}
+
+		idle.emplace_back(std::move(context));
+	}
+
+	void ContextPool::prewarm(const ContextConfig& config) {
+		while (true) {
+			{
+				std::lock_guard lock(mutex_);
+				if (idle_[make_key(config)].size() >= n_min_) return;
+			}
+
+			std::unique_ptr<LlamaContext> context = create(config);
+
+			// Other refills or releases may have filled the pool meanwhile, the extra context is dropped outside the lock.
+			std::unique_lock lock(mutex_);
+			auto& idle = idle_[make_key(config)];
+			if (idle.size() >= n_min_ || idle.size() >= n_max_) {
+				lock.unlock();
+				return;
+			}
+
+			idle.emplace_back(std::move(context));
+		}
+	}
+
+	std::unique_ptr<LlamaContext> ContextPool::create(const ContextConfig& config) const {
+		llama_context_params llm_context_params = llama_context_default_params();
+		llm_context_params.n_ctx = config.n_ctx;
+		llm_context_params.n_batch = config.n_batch;
+		llm_context_params.n_ubatch = config.n_ubatch;
+
+		return std::make_unique<LlamaContext>(llm_context_params, model_);
+	}
+
+	void ContextPool::refill_loop() {
+		while (true) {
+			ContextConfig config;
+			{
+				std::unique_lock lock(mutex_);
+				refill_cv_.wait(lock, [this] { return stop_ || !refill_queue_.empty(); });
+				if (stop_) return;
+
+				config = refill_queue_.back();
+				refill_queue_.pop_back();
+			}
+
+			try { prewarm(config); }
+			catch (const LlamaException& e) { log_warn(std::format("ContextPool: Failed to prewarm context: {}", e.what())); }
+		}
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,219 @@
+#include "embedding_cache.h"
+#include "utils.h"
+#include "llama_log.h"
+#include "mtmd.h"
+
+#include <filesystem>
+#include <fstream>
+#include <format>
+#include <cstring>
+
+namespace llama_server::internal {
+
+	namespace embedding_cache_detail {
+
+		constexpr uint32_t file_magic = 0x44424d45;		// "EMBD"
+		constexpr uint32_t file_version = 1;
+
+		// magic, version, n_chunks, then n_chunks float counts, then the floats of all chunks.
+		struct FileHeader {
+			uint32_t magic;
+			uint32_t version;
+			uint64_t n_chunks;
+		};
+
+	}
+
+	using namespace embedding_cache_detail;
+
+	// ===================================================================
+	// MediaEmbeddings
+	// ===================================================================
+
+	size_t MediaEmbeddings::get_bytes() const {
+		size_t n_bytes = 0;
+		for (auto& chunk : chunks) n_bytes += chunk.size_bytes();
+		return n_bytes;
+	}
+
+	bool MediaEmbeddings::matches(const mtmd_input_chunks* input, size_t n_embd) const {
+		size_t media_idx = 0;
+		const size_t n_input = mtmd_input_chunks_size(input);
+		for (size_t i = 0; i < n_input; i++) {
+			const mtmd_input_chunk* chunk = mtmd_input_chunks_get(input, i);
+			if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) continue;
+
+			if (media_idx >= chunks.size()) return false;
+			if (chunks[media_idx++].size() != mtmd_input_chunk_get_n_tokens(chunk) * n_embd) return false;
+		}
+		return media_idx == chunks.size();
+	}
+
+	// ===================================================================
+	// EmbeddingCache
+	// ===================================================================
+
+	EmbeddingCache::EmbeddingCache(size_t byte_budget, std::string_view dir, std::string_view projector_identity)
+		: byte_budget_(byte_budget), dir_(dir) {
+		projector_id_ = std::format("{:016x}", (uint64_t)std::hash<std::string_view>{}(projector_identity));
+
+		if (dir_.empty()) return;
+
+		std::error_code ec;
+		std::filesystem::create_directories(dir_, ec);
+		if (ec) {
+			log_warn(std::format("EmbeddingCache: Disk cache disabled, cannot create {}: {}", dir_, ec.message()));
+			dir_.clear();
+		}
+	}
+
+	EmbeddingCache::~EmbeddingCache() = default;
+
+	MediaEmbeddingsPtr EmbeddingCache::find(std::string_view id) {
+		{
+			std::lock_guard lock(mutex_);
+
+			auto it = index_.find(id);
+			if (it != index_.end()) {
+				entries_.splice(entries_.begin(), entries_, it->second);
+				n_hits_++;
+				return it->second->embeddings;
+			}
+		}
+
+		MediaEmbeddingsPtr embeddings = load(id);
+		if (!embeddings) {
+			n_misses_++;
+			return nullptr;
+		}
+
+		n_disk_hits_++;
+
+		std::lock_guard lock(mutex_);
+		insert_locked(id, embeddings);
+		return embeddings;
+	}
+
+	void EmbeddingCache::insert(std::string_view id, MediaEmbeddingsPtr embeddings) {
+		std::lock_guard lock(mutex_);
+		insert_locked(id, std::move(embeddings));
+	}
+
+	void EmbeddingCache::remove(std::string_view id) {
+		{
+			std::lock_guard lock(mutex_);
+			auto it = index_.find(id);
+			if (it != index_.end()) erase(it->second);
+		}
+
+		if (dir_.empty()) return;
+		std::error_code ec;
+		std::filesystem::remove(get_path(id), ec);
+	}
+
+	void EmbeddingCache::save(std::string_view id, const MediaEmbeddings& embeddings) const {
+		if (dir_.empty()) return;
+
+		const std::string path = get_path(id);
+		std::error_code ec;
+		if (std::filesystem::exists(path, ec)) return;
+
+		// Written aside and renamed, so a reader never maps a partial file.
+		const std::string tmp_path = std::format("{}.{:x}.tmp", path, (uint64_t)std::hash<const void*>{}(&embeddings));
+		{
+			std::ofstream file(tmp_path, std::ios::binary);
+			if (!file) {
+				log_warn(std::format("EmbeddingCache: Failed to write {}", tmp_path));
+				return;
+			}
+
+			FileHeader header{ .magic = file_magic, .version = file_version, .n_chunks = embeddings.chunks.size() };
+			file.write((const char*)&header, sizeof(header));
+			for (auto& chunk : embeddings.chunks) {
+				uint64_t n_floats = chunk.size();
+				file.write((const char*)&n_floats, sizeof(n_floats));
+			}
+			for (auto& chunk : embeddings.chunks) file.write((const char*)chunk.data(), chunk.size_bytes());
+
+			if (!file) {
+				file.close();
+				std::filesystem::remove(tmp_path, ec);
+				log_warn(std::format("EmbeddingCache: Failed to write {}", tmp_path));
+				return;
+			}
+		}
+
+		std::filesystem::rename(tmp_path, path, ec);
+		if (ec) std::filesystem::remove(tmp_path, ec);
+	}
+
+	std::string EmbeddingCache::get_path(std::string_view id) const {
+		return (std::filesystem::path(dir_) / std::format("{}-{}.embd", projector_id_, id)).string();
+	}
+
+	MediaEmbeddingsPtr EmbeddingCache::load(std::string_view id) const {
+		if (dir_.empty()) return nullptr;
+
+		const std::string path = get_path(id);
+		std::error_code ec;
+		if (!std::filesystem::exists(path, ec)) return nullptr;
+
+		std::shared_ptr<MappedFile> file;
+		try { file = std::make_shared<MappedFile>(path); }
+		catch (const LlamaException& e) {
+			log_warn(std::format("EmbeddingCache: {}", e.what()));
+			return nullptr;
+		}
+
+		auto discard = [&] {
+			log_warn(std::format("EmbeddingCache: Removing corrupt file {}", path));
+			file.reset();
+			std::filesystem::remove(path, ec);
+			return nullptr;
+		};
+
+		FileHeader header;
+		if (file->size() < sizeof(header)) return discard();
+		std::memcpy(&header, file->data(), sizeof(header));
+		if (header.magic != file_magic || header.version != file_version) return discard();
+
+		const size_t counts_end = sizeof(header) + header.n_chunks * sizeof(uint64_t);
+		if (header.n_chunks > file->size() || counts_end > file->size()) return discard();
+
+		auto embeddings = std::make_shared<MediaEmbeddings>();
+		size_t offset = counts_end;
+		for (uint64_t i = 0; i < header.n_chunks; i++) {
+			uint64_t n_floats;
+			std::memcpy(&n_floats, file->data() + sizeof(header) + i * sizeof(uint64_t), sizeof(n_floats));
+			if (n_floats > (file->size() - offset) / sizeof(float)) return discard();
+
+			embeddings->chunks.emplace_back((const float*)(file->data() + offset), n_floats);
+			offset += n_floats * sizeof(float);
+		}
+		if (offset != file->size()) return discard();
+
+		embeddings->storage = std::move(file);
+		return embeddings;
+	}
+
+	void EmbeddingCache::insert_locked(std::string_view id, MediaEmbeddingsPtr embeddings) {
+		const size_t n_bytes = embeddings->get_bytes();
+		if (n_bytes > byte_budget_) return;
+
+		auto it = index_.find(id);
+		if (it != index_.end()) erase(it->second);
+
+		while (!entries_.empty() && n_bytes_ + n_bytes > byte_budget_) erase(std::prev(entries_.end()));
+
+		entries_.emplace_front(Entry{ .id = std::string(id), .embeddings = std::move(embeddings), .n_bytes = n_bytes });
+		index_.emplace(entries_.front().id, entries_.begin());
+		n_bytes_ += n_bytes;
+	}
+
+	void EmbeddingCache::erase(std::list<Entry>::iterator it) {
+		n_bytes_ -= it->n_bytes;
+		index_.erase(it->id);
+		entries_.erase(it);
+	}
+
+}
@@ -0,0 +1,138 @@
+#include "grammar_cache.h"
+#include "llama_log.h"
+#include "llama.h"
+#include "common.h"
+
+#include <algorithm>
+#include <format>
+
+namespace llama_server::internal {
+
+	// ===================================================================
+	// GrammarCache::SamplerDeleter
+	// ===================================================================
+
+	void GrammarCache::SamplerDeleter::operator()(llama_sampler* sampler) const { llama_sampler_free(sampler); }
+
+	// ===================================================================
+	// GrammarCache
+	// ===================================================================
+
+	GrammarCache::GrammarCache(const llama_vocab* vocab, size_t capacity)
+		: vocab_(vocab), capacity_(capacity) {}
+
+	GrammarCache::~GrammarCache() = default;
+
+	llama_sampler* GrammarCache::acquire(const Grammar& grammar) {
+		std::string key = make_key(grammar);
+
+		{
+			std::lock_guard lock(mutex_);
+
+			auto it = entries_.find(key);
+			if (it != entries_.end()) {
+				it->second.last_used = ++tick_;
+				n_hits_++;
+				return llama_sampler_clone(it->second.sampler.get());
+			}
+		}
+
+		n_misses_++;
+
+		// Compiling may take tens of milliseconds, other grammars stay available meanwhile.
+		SamplerPtr compiled(compile(grammar, vocab_));
+		llama_sampler* result = llama_sampler_clone(compiled.get());
+
+		std::lock_guard lock(mutex_);
+
+		if (capacity_ == 0 || entries_.contains(key)) return result;
+
+		if (entries_.size() >= capacity_) {
+			entries_.erase(std::min_element(entries_.begin(), entries_.end(), [](const auto& lhs, const auto& rhs) {
+				return lhs.second.last_used < rhs.second.last_used;
+			}));
+		}
+		entries_.emplace(std::move(key), Entry{ .sampler = std::move(compiled), .last_used = ++tick_ });
+
+		return result;
+	}
+
+	std::string GrammarCache::make_key(const Grammar& grammar) {
+		// Length prefixes keep distinct grammars from serializing to the same key.
+		std::string key = std::format("{}:{}:", grammar.lazy, grammar.value.size());
+		key += grammar.value;
+		for (const auto& trigger : grammar.triggers) {
+			key += std::format("|{}:{}:{}:", (int)trigger.type, trigger.token, trigger.value.size());
+			key += trigger.value;
+		}
+		return key;
+	}
+
+	// Copy from sampling.cpp
+	llama_sampler* GrammarCache::compile(const Grammar& grammar, const llama_vocab* vocab) {
+		struct llama_sampler* grmr;
+		if (grammar.value.compare(0, 11, "%llguidance") == 0) {
+#ifdef LLAMA_USE_LLGUIDANCE
+			grmr = llama_sampler_init_llg(vocab, "lark", grammar.value.c_str());
+#else
+			GGML_ABORT("llguidance (cmake -DLLAMA_LLGUIDANCE=ON) is not enabled");
+#endif // LLAMA_USE_LLGUIDANCE
+		}
+		else {
+			std::vector<std::string> trigger_patterns;
+			std::vector<std::string> patterns_anywhere;
+			std::vector<llama_token> trigger_tokens;
+			for (const auto& trigger : grammar.triggers) {
+				switch (trigger.type) {
+				case GrammarTrigger::WORD:
+				{
+					const auto& word = trigger.value;
+					patterns_anywhere.push_back(regex_escape(word));
+					break;
+				}
+				case GrammarTrigger::PATTERN:
+				{
+					patterns_anywhere.push_back(trigger.value);
+					break;
+				}
+				case GrammarTrigger::PATTERN_FULL:
+				{
+					trigger_patterns.push_back(trigger.value);
+					break;
+				}
+				case GrammarTrigger::TOKEN:
+				{
+					const auto token = trigger.token;
+					trigger_tokens.push_back(token);
+					break;
+				}
+				default:
+					GGML_ASSERT(false && "unknown trigger type");
+				}
+			}
+
+			if (!patterns_anywhere.empty()) {
+				trigger_patterns.push_back("^[\\s\\S]*?(" + string_join(patterns_anywhere, "|") + ")[\\s\\S]*");
+			}
+
+			std::vector<const char*> trigger_patterns_c;
+			trigger_patterns_c.reserve(trigger_patterns.size());
+			for (const auto& regex : trigger_patterns) {
+				trigger_patterns_c.push_back(regex.c_str());
+			}
+
+			grmr = grammar.lazy
+				? llama_sampler_init_grammar_lazy_patterns(vocab, grammar.value.c_str(), "root",
+					trigger_patterns_c.data(), trigger_patterns_c.size(),
+					trigger_tokens.data(), trigger_tokens.size())
+				: llama_sampler_init_grammar(vocab, grammar.value.c_str(), "root");
+
+			if (!grmr) {
+				throw LlamaException("Failed to initialize grammar sampler");
+			}
+
+			return grmr;
+		}
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+#include "media_cache.h"
+
+#include <format>
+
+namespace llama_server::internal {
+
+	MediaCache::MediaCache(size_t byte_budget)
+		: byte_budget_(byte_budget) {}
+
+	MediaCache::~MediaCache() = default;
+
+	std::string MediaCache::make_id(std::string_view bytes) {
+		return std::format("{:016x}-{}", (uint64_t)std::hash<std::string_view>{}(bytes), bytes.size());
+	}
+
+	IDChunksPtr MediaCache::find(std::string_view id) {
+		std::lock_guard lock(mutex_);
+
+		auto it = index_.find(id);
+		if (it == index_.end()) {
+			n_misses_++;
+			return nullptr;
+		}
+
+		entries_.splice(entries_.begin(), entries_, it->second);
+		n_hits_++;
+		return it->second->chunks;
+	}
+
+	void MediaCache::insert(IDChunksPtr chunks, size_t n_bytes) {
+		if (n_bytes > byte_budget_) return;
+
+		std::lock_guard lock(mutex_);
+
+		// Another session may have tokenized the same media meanwhile.
+		auto it = index_.find(chunks->id);
+		if (it != index_.end()) erase(it->second);
+
+		while (!entries_.empty() && n_bytes_ + n_bytes > byte_budget_) erase(std::prev(entries_.end()));
+
+		entries_.emplace_front(Entry{ .chunks = std::move(chunks), .n_bytes = n_bytes });
+		index_.emplace(entries_.front().chunks->id, entries_.begin());
+		n_bytes_ += n_bytes;
+	}
+
+	size_t MediaCache::get_bytes() const {
+		std::lock_guard lock(mutex_);
+		return n_bytes_;
+	}
+
+	void MediaCache::erase(std::list<Entry>::iterator it) {
+		n_bytes_ -= it->n_bytes;
+		index_.erase(it->chunks->id);
+		entries_.erase(it);
+	}
+
+}
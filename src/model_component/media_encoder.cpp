@@ -0,0 +1,155 @@
+#include "media_encoder.h"
+#include "media_cache.h"
+#include "llama_model.h"
+#include "llama_log.h"
+#include "llama.h"
+#include "mtmd.h"
+#include "mtmd-helper.h"
+
+#include <algorithm>
+#include <format>
+#include <thread>
+
+namespace llama_server::internal {
+
+	namespace media_encoder_detail {
+
+		// Decoding and preprocessing are CPU bound, leave cores to the text model.
+		inline size_t preprocess_threads() {
+			return std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+		}
+
+	}
+
+	using namespace media_encoder_detail;
+
+	MediaEncoder::MediaEncoder(const LlamaModel& model)
+		: model_(model), tokenizer_(model), preprocess_pool_(preprocess_threads()), encode_pool_(1) {}
+
+	MediaEncoder::~MediaEncoder() = default;
+
+	std::future<IDChunksPtr> MediaEncoder::load(std::string_view path) {
+		return preprocess_pool_.submit([this, path = std::string(path)] {
+			auto bytes = std::make_shared<const std::string>(read_file(path));
+			return load_sync(MediaBuffer{ .id = MediaCache::make_id(*bytes), .data = std::move(bytes) }, path);
+		});
+	}
+
+	std::future<IDChunksPtr> MediaEncoder::load(MediaBuffer buffer) {
+		return preprocess_pool_.submit([this, buffer = std::move(buffer)] { return load_sync(buffer, buffer.id); });
+	}
+
+	std::shared_future<MediaEmbeddingsPtr> MediaEncoder::encode(IDChunksPtr chunks) {
+		EmbeddingCache& cache = model_.get_embedding_cache();
+		if (MediaEmbeddingsPtr cached = cache.find(chunks->id)) {
+			// A file written by another projector build, or a truncated one, would feed the decode the wrong sizes.
+			if (cached->matches(chunks->chunks.get(), llama_model_n_embd(model_.get_data()))) {
+				std::promise<MediaEmbeddingsPtr> ready;
+				ready.set_value(std::move(cached));
+				return ready.get_future().share();
+			}
+
+			log_warn(std::format("MediaEncoder: Cached embeddings of {} do not match its chunks, encoding again", chunks->id));
+			cache.remove(chunks->id);
+		}
+
+		std::lock_guard lock(mutex_);
+
+		auto it = in_flight_.find(chunks->id);
+		if (it != in_flight_.end()) return it->second;
+
+		std::shared_future<MediaEmbeddingsPtr> result = encode_pool_.submit([this, &cache, chunks] {
+			MediaEmbeddingsPtr embeddings;
+			try { embeddings = encode_sync(*chunks); }
+			catch (...) {
+				std::lock_guard lock(mutex_);
+				in_flight_.erase(chunks->id);
+				throw;
+			}
+
+			cache.insert(chunks->id, embeddings);
+			if (cache.has_disk()) {
+				preprocess_pool_.submit([&cache, id = chunks->id, embeddings] { cache.save(id, *embeddings); });
+			}
+
+			std::lock_guard lock(mutex_);
+			in_flight_.erase(chunks->id);
+			return embeddings;
+		}).share();
+
+		in_flight_.emplace(chunks->id, result);
+		return result;
+	}
+
+	MediaBuffer MediaEncoder::make_buffer(Media media) {
+		if (!media.data) throw LlamaException(std::format("Media {} has no data", media.handle));
+
+		MediaBuffer buffer = { .id = MediaCache::make_id(*media.data), .data = std::move(media.data), .width = media.width, .height = media.height };
+		if (!buffer.width && !buffer.height) return buffer;
+
+		if ((size_t)buffer.width * buffer.height * 3 != buffer.data->size()) {
+			throw LlamaException(std::format("Media {} is not {}x{} RGB pixels", media.handle, buffer.width, buffer.height));
+		}
+		// The same pixels read with other dimensions are another image.
+		buffer.id += std::format("-{}x{}", buffer.width, buffer.height);
+		return buffer;
+	}
+
+	IDChunksPtr MediaEncoder::load_sync(const MediaBuffer& buffer, std::string_view name) {
+		const std::string& id = buffer.id;
+		const std::string& bytes = *buffer.data;
+
+		// Media are identified by their bytes, a file rewritten at the same path is a new media.
+		MediaCache& cache = model_.get_media_cache();
+		if (IDChunksPtr cached = cache.find(id)) return cached;
+
+		mtmd::bitmap bmp = buffer.width
+			? mtmd::bitmap(buffer.width, buffer.height, (const unsigned char*)bytes.data())
+			: mtmd::bitmap(mtmd_helper_bitmap_init_from_buf(model_.get_mtmd(), (const unsigned char*)bytes.data(), bytes.size()));
+		if (!bmp.ptr) throw LlamaException(std::format("Failed to load media {}", name));
+		bmp.set_id(id.c_str());
+
+		// The chunk keeps the preprocessed media in f32, about the decoded size times four.
+		const size_t n_bytes = bmp.n_bytes() * sizeof(float);
+
+		mtmd::bitmaps bitmaps;
+		bitmaps.entries.emplace_back(std::move(bmp));
+
+		auto chunks = tokenizer_.mtmd_tokenize(mtmd_default_marker(), bitmaps, false);
+		IDChunksPtr result = std::make_shared<IDChunks>(std::string(id), std::move(chunks));
+		cache.insert(result, n_bytes);
+
+		return result;
+	}
+
+	MediaEmbeddingsPtr MediaEncoder::encode_sync(const IDChunks& chunks) {
+		const size_t n_embd = llama_model_n_embd(model_.get_data());
+		auto storage = std::make_shared<std::vector<float>>();
+		std::vector<size_t> n_floats;
+
+		const size_t n_chunks = mtmd_input_chunks_size(chunks.chunks.get());
+		for (size_t i = 0; i < n_chunks; i++) {
+			const mtmd_input_chunk* chunk = mtmd_input_chunks_get(chunks.chunks.get(), i);
+			if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) continue;
+
+			if (mtmd_encode_chunk(model_.get_mtmd(), chunk)) {
+				throw LlamaException(std::format("Failed to encode media {}", chunks.id));
+			}
+
+			const float* output = mtmd_get_output_embd(model_.get_mtmd());
+			n_floats.emplace_back(mtmd_input_chunk_get_n_tokens(chunk) * n_embd);
+			storage->insert(storage->end(), output, output + n_floats.back());
+		}
+
+		auto embeddings = std::make_shared<MediaEmbeddings>();
+		size_t offset = 0;
+		for (size_t n : n_floats) {
+			embeddings->chunks.emplace_back(storage->data() + offset, n);
+			offset += n;
+		}
+		embeddings->storage = std::move(storage);
+
+		return embeddings;
+	}
+
+}
@@ -0,0 +1,30 @@
+#include "piece_table.h"
+
+#include <format>
+
+namespace llama_server::internal {
+
+	PieceTable::PieceTable(const llama_vocab* vocab) {
+		const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+		offsets_.reserve((size_t)n_vocab + 1);
+		offsets_.emplace_back(0);
+		arena_.reserve((size_t)n_vocab * 8);
+
+		std::string buffer(256, '\0');
+		for (llama_token token = 0; token < n_vocab; token++) {
+			int32_t n_chars = llama_token_to_piece(vocab, token, buffer.data(), (int32_t)buffer.size(), 0, false);
+			if (n_chars < 0) {
+				buffer.resize(-n_chars);
+				n_chars = llama_token_to_piece(vocab, token, buffer.data(), (int32_t)buffer.size(), 0, false);
+			}
+			if (n_chars < 0) throw LlamaException(std::format("Failed to detokenize token {}.", token));
+
+			arena_.append(buffer.data(), n_chars);
+			offsets_.emplace_back((uint32_t)arena_.size());
+		}
+
+		arena_.shrink_to_fit();
+	}
+
+}
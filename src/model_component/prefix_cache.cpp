@@ -0,0 +1,204 @@
+#include "prefix_cache.h"
+#include "llama_log.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <format>
+
+namespace llama_server::internal {
+
+	namespace prefix_cache_detail {
+
+		constexpr PrefixCache::Key media_bit = 1ull << 63;
+		constexpr int index_bits = 20;
+		constexpr PrefixCache::Key index_mask = (1ull << index_bits) - 1;
+
+		inline size_t common_prefix(std::span<const PrefixCache::Key> lhs, std::span<const PrefixCache::Key> rhs) {
+			size_t n = 0;
+			while (n < lhs.size() && n < rhs.size() && lhs[n] == rhs[n]) ++n;
+			return n;
+		}
+
+	}
+
+	using namespace prefix_cache_detail;
+
+	PrefixCache::PrefixCache(std::vector<llama_seq_id> slots, size_t n_token_budget)
+		: n_token_budget_(n_token_budget) {
+		for (auto seq_id : slots) slots_.emplace_back(Slot{ .seq_id = seq_id });
+	}
+
+	PrefixCache::~PrefixCache() = default;
+
+	std::vector<PrefixCache::Key> PrefixCache::make_keys(std::span<IDChunksPtr const> chunks) {
+		std::vector<Key> keys;
+
+		for (auto& chunk : chunks) {
+			if (chunk->type == TEXT) {
+				keys.insert(keys.end(), chunk->text_tokens.begin(), chunk->text_tokens.end());
+				continue;
+			}
+
+			for (size_t i = 0; i < chunk->n_tokens; i++) keys.emplace_back(make_media_key(chunk->id, i));
+		}
+
+		return keys;
+	}
+
+	PrefixCache::Key PrefixCache::make_media_key(std::string_view id, size_t index) {
+		Key id_hash = (Key)std::hash<std::string_view>{}(id) << index_bits;
+		return media_bit | (id_hash & ~media_bit) | ((Key)index & index_mask);
+	}
+
+	// Keys of a media chunk share its id hash, only the first one has index 0.
+	bool PrefixCache::is_media_continuation(Key key) { return (key & media_bit) && (key & index_mask) != 0; }
+
+	size_t PrefixCache::restore(llama_context* context, llama_seq_id dst, std::span<const Key> keys, size_t n_min) {
+		auto [slot_idx, n_keep] = lookup(keys);
+		if (slot_idx < 0 || n_keep <= n_min) return 0;
+
+		Slot& slot = slots_[slot_idx];
+		slot.last_used = ++tick_;
+
+		llama_memory_t kv_mem = llama_get_memory(context);
+		llama_memory_seq_rm(kv_mem, dst, -1, -1);
+		llama_memory_seq_cp(kv_mem, slot.seq_id, dst, 0, (llama_pos)n_keep);
+
+		log_info(std::format("PrefixCache: Restored {} tokens from sequence {}", n_keep, slot.seq_id));
+
+		return n_keep;
+	}
+
+	void PrefixCache::store(llama_context* context, llama_seq_id src, std::span<const Key> keys) {
+		if (keys.empty() || keys.size() > n_token_budget_) return;
+
+		auto [slot_idx, n_keep] = lookup(keys);
+
+		if (slot_idx >= 0 && n_keep == keys.size()) {
+			slots_[slot_idx].last_used = ++tick_;
+			return;
+		}
+
+		// A slot whose whole prefix is extended by keys is replaced, otherwise take a free slot or the least recently used one.
+		if (slot_idx < 0 || n_keep != slots_[slot_idx].keys.size()) {
+			auto free_slot = std::find_if(slots_.begin(), slots_.end(), [](const Slot& slot) { return slot.keys.empty(); });
+			slot_idx = free_slot != slots_.end()
+				? (int32_t)(free_slot - slots_.begin())
+				: (int32_t)(std::min_element(slots_.begin(), slots_.end(), [](const Slot& lhs, const Slot& rhs) { return lhs.last_used < rhs.last_used; }) - slots_.begin());
+		}
+
+		evict(context, slot_idx);
+
+		Slot& slot = slots_[slot_idx];
+		llama_memory_seq_cp(llama_get_memory(context), src, slot.seq_id, 0, (llama_pos)keys.size());
+		slot.keys.assign(keys.begin(), keys.end());
+		slot.last_used = ++tick_;
+		n_tokens_ += keys.size();
+
+		insert(slot_idx);
+
+		while (n_tokens_ > n_token_budget_) {
+			auto lru = std::min_element(slots_.begin(), slots_.end(), [](const Slot& lhs, const Slot& rhs) {
+				if (lhs.keys.empty() != rhs.keys.empty()) return rhs.keys.empty();
+				return lhs.last_used < rhs.last_used;
+			});
+			evict(context, lru - slots_.begin());
+		}
+	}
+
+	std::pair<int32_t, size_t> PrefixCache::lookup(std::span<const Key> keys) const {
+		const Node* node = &root_;
+		int32_t slot_idx = -1;
+		size_t n_keep = 0;
+
+		while (n_keep < keys.size()) {
+			auto it = node->children.find(keys[n_keep]);
+			if (it == node->children.end()) break;
+
+			const Node* child = it->second.get();
+			size_t n_common = common_prefix(child->edge, keys.subspan(n_keep));
+
+			n_keep += n_common;
+			slot_idx = (int32_t)*std::max_element(child->holders.begin(), child->holders.end(), [this](size_t lhs, size_t rhs) {
+				return slots_[lhs].last_used < slots_[rhs].last_used;
+			});
+
+			if (n_common < child->edge.size()) break;
+			node = child;
+		}
+
+		// A media chunk is only reusable as a whole.
+		while (n_keep > 0 && n_keep < keys.size() && is_media_continuation(keys[n_keep])) --n_keep;
+
+		return { slot_idx, n_keep };
+	}
+
+	void PrefixCache::insert(size_t slot_idx) {
+		std::span<const Key> keys = slots_[slot_idx].keys;
+		Node* node = &root_;
+		size_t i = 0;
+
+		while (i < keys.size()) {
+			auto it = node->children.find(keys[i]);
+			if (it == node->children.end()) {
+				auto child = std::make_unique<Node>();
+				child->edge.assign(keys.begin() + i, keys.end());
+				child->holders.emplace_back(slot_idx);
+				node->children.emplace(keys[i], std::move(child));
+				return;
+			}
+
+			Node* child = it->second.get();
+			size_t n_common = common_prefix(child->edge, keys.subspan(i));
+
+			// Split the edge at the divergence point.
+			if (n_common < child->edge.size()) {
+				auto middle = std::make_unique<Node>();
+				middle->edge.assign(child->edge.begin(), child->edge.begin() + n_common);
+				middle->holders = child->holders;
+
+				std::unique_ptr<Node> tail = std::move(it->second);
+				tail->edge.erase(tail->edge.begin(), tail->edge.begin() + n_common);
+				middle->children.emplace(tail->edge.front(), std::move(tail));
+
+				it->second = std::move(middle);
+				child = it->second.get();
+			}
+
+			child->holders.emplace_back(slot_idx);
+			node = child;
+			i += n_common;
+		}
+	}
+
+	void PrefixCache::evict(llama_context* context, size_t slot_idx) {
+		Slot& slot = slots_[slot_idx];
+		if (slot.keys.empty()) return;
+
+		std::span<const Key> keys = slot.keys;
+		Node* node = &root_;
+		size_t i = 0;
+
+		while (i < keys.size()) {
+			auto it = node->children.find(keys[i]);
+			if (it == node->children.end()) break;
+
+			Node* child = it->second.get();
+			std::erase(child->holders, slot_idx);
+
+			// Holders of a subtree are a subset of its root's holders.
+			if (child->holders.empty()) {
+				node->children.erase(it);
+				break;
+			}
+
+			i += child->edge.size();
+			node = child;
+		}
+
+		llama_memory_seq_rm(llama_get_memory(context), slot.seq_id, -1, -1);
+		n_tokens_ -= slot.keys.size();
+		slot.keys.clear();
+	}
+
+}
\ No newline at end of file
@@ -0,0 +1,165 @@
+#include "request_scheduler.h"
+#include "llama_log.h"
+
+#include <algorithm>
+#include <format>
+
+namespace llama_server::internal {
+
+	namespace request_scheduler_detail {
+
+		// Cancellation and queue timeouts are noticed within this interval while waiting.
+		constexpr auto poll_interval = std::chrono::milliseconds(20);
+
+	}
+
+	using namespace request_scheduler_detail;
+
+	// ===================================================================
+	// RequestScheduler
+	// ===================================================================
+
+	RequestScheduler::RequestScheduler(
+		size_t max_active,
+		size_t max_queued,
+		std::chrono::milliseconds queue_timeout
+	) : max_active_(std::max<size_t>(max_active, 1)), max_queued_(max_queued), queue_timeout_(queue_timeout) {}
+
+	RequestScheduler::~RequestScheduler() = default;
+
+	std::unique_ptr<SchedulerTicket> RequestScheduler::enqueue(Priority priority) {
+		std::lock_guard lock(mutex_);
+
+		if (queued_.size() >= max_queued_ && active_.size() >= max_active_) {
+			n_rejected_++;
+			throw AdmissionException(std::format("RequestScheduler: Queue is full ({} waiting).", queued_.size()));
+		}
+
+		auto entry = std::make_shared<Entry>(Entry{
+			.priority = priority,
+			.order = next_order_++,
+			.queued_at = std::chrono::steady_clock::now()
+		});
+		queued_.emplace_back(entry);
+		schedule();
+
+		return std::unique_ptr<SchedulerTicket>(new SchedulerTicket(shared_from_this(), std::move(entry)));
+	}
+
+	RequestScheduler::Admission RequestScheduler::check(Entry& entry, const std::function<bool()>& abort_check) {
+		if (entry.state == State::ACTIVE) return Admission::ADMITTED;
+		if (entry.state == State::DONE) return Admission::DROPPED;
+
+		if (abort_check && abort_check()) {
+			remove(entry);
+			return Admission::DROPPED;
+		}
+
+		// Timeouts are applied by schedule, an entry still queued has time left.
+		schedule();
+		return entry.state == State::ACTIVE ? Admission::ADMITTED
+			: entry.state == State::DONE ? Admission::DROPPED
+			: Admission::QUEUED;
+	}
+
+	void RequestScheduler::remove(Entry& entry) {
+		std::erase_if(queued_, [&entry](const std::shared_ptr<Entry>& other) { return other.get() == &entry; });
+		std::erase_if(active_, [&entry](const std::shared_ptr<Entry>& other) { return other.get() == &entry; });
+		entry.state = State::DONE;
+
+		schedule();
+	}
+
+	void RequestScheduler::schedule() {
+		auto before = [](const std::shared_ptr<Entry>& lhs, const std::shared_ptr<Entry>& rhs) {
+			if (lhs->priority != rhs->priority) return lhs->priority > rhs->priority;
+			return lhs->order < rhs->order;
+		};
+		// Preempted entries count from the moment they yielded, an owner which never steps again does not keep its place.
+		const auto now = std::chrono::steady_clock::now();
+		std::erase_if(queued_, [this, now](const std::shared_ptr<Entry>& entry) {
+			if (now - entry->queued_at < queue_timeout_) return false;
+
+			log_warn(std::format("RequestScheduler: {} request timed out in the queue.", entry->preempted ? "Preempted" : "Queued"));
+			n_timed_out_++;
+			entry->state = State::DONE;
+			return true;
+		});
+
+		std::sort(queued_.begin(), queued_.end(), before);
+
+		bool admitted = false;
+		while (!queued_.empty() && active_.size() < max_active_) {
+			auto entry = queued_.front();
+			queued_.erase(queued_.begin());
+
+			entry->state = State::ACTIVE;
+			entry->yield_requested = false;
+			active_.emplace_back(std::move(entry));
+			admitted = true;
+		}
+
+		// Ask the lowest priority generations to make room for waiting requests that outrank them.
+		size_t n_yielding = std::ranges::count_if(active_, [](const std::shared_ptr<Entry>& entry) { return entry->yield_requested; });
+		for (auto& waiting : queued_) {
+			if (n_yielding >= queued_.size()) break;
+
+			auto victim = std::ranges::max_element(active_, [](const std::shared_ptr<Entry>& lhs, const std::shared_ptr<Entry>& rhs) {
+				if (lhs->yield_requested != rhs->yield_requested) return !rhs->yield_requested;
+				if (lhs->priority != rhs->priority) return lhs->priority > rhs->priority;
+				return lhs->order < rhs->order;
+			});
+			if (victim == active_.end() || (*victim)->yield_requested || (*victim)->priority >= waiting->priority) break;
+
+			(*victim)->yield_requested = true;
+			n_yielding++;
+		}
+
+		if (admitted) admitted_cv_.notify_all();
+	}
+
+	// ===================================================================
+	// SchedulerTicket
+	// ===================================================================
+
+	SchedulerTicket::~SchedulerTicket() {
+		std::lock_guard lock(scheduler_->mutex_);
+		if (entry_->state != RequestScheduler::State::DONE) scheduler_->remove(*entry_);
+	}
+
+	SchedulerTicket::Admission SchedulerTicket::wait(const std::function<bool()>& abort_check) {
+		std::unique_lock lock(scheduler_->mutex_);
+
+		while (true) {
+			Admission admission = scheduler_->check(*entry_, abort_check);
+			if (admission != Admission::QUEUED) return admission;
+
+			scheduler_->admitted_cv_.wait_for(lock, poll_interval);
+		}
+	}
+
+	SchedulerTicket::Admission SchedulerTicket::poll(const std::function<bool()>& abort_check) {
+		std::lock_guard lock(scheduler_->mutex_);
+		return scheduler_->check(*entry_, abort_check);
+	}
+
+	bool SchedulerTicket::should_yield() const {
+		std::lock_guard lock(scheduler_->mutex_);
+		return entry_->yield_requested;
+	}
+
+	void SchedulerTicket::yield() {
+		std::lock_guard lock(scheduler_->mutex_);
+
+		std::erase(scheduler_->active_, entry_);
+		entry_->state = RequestScheduler::State::QUEUED;
+		entry_->yield_requested = false;
+		entry_->preempted = true;
+		entry_->queued_at = std::chrono::steady_clock::now();
+		scheduler_->queued_.emplace_back(entry_);
+		scheduler_->n_preempted_++;
+
+		scheduler_->schedule();
+	}
+
+}
@@ -0,0 +1,83 @@
+#include "token_cache.h"
+
+namespace llama_server::internal {
+
+	namespace token_cache_detail {
+
+		// Tokenizing fewer bytes costs about as much as a lookup.
+		constexpr size_t min_text_bytes = 64;
+		// Node, index and allocation overhead of one entry.
+		constexpr size_t entry_overhead_bytes = 96;
+
+	}
+
+	using namespace token_cache_detail;
+
+	TokenCache::TokenCache(size_t byte_budget)
+		: byte_budget_(byte_budget) {}
+
+	TokenCache::~TokenCache() = default;
+
+	std::optional<std::vector<llama_token>> TokenCache::find(std::string_view text, bool add_special, bool parse_special) {
+		if (text.size() < min_text_bytes || byte_budget_ == 0) return std::nullopt;
+
+		const uint64_t key = make_key(text, add_special, parse_special);
+
+		std::lock_guard lock(mutex_);
+
+		auto it = index_.find(key);
+		if (it == index_.end() || it->second->text != text) {
+			n_misses_++;
+			return std::nullopt;
+		}
+
+		entries_.splice(entries_.begin(), entries_, it->second);
+		n_hits_++;
+		return it->second->tokens;
+	}
+
+	void TokenCache::insert(std::string_view text, bool add_special, bool parse_special, const std::vector<llama_token>& tokens) {
+		if (text.size() < min_text_bytes) return;
+
+		Entry entry{
+			.key = make_key(text, add_special, parse_special),
+			.text = std::string(text),
+			.tokens = tokens
+		};
+		const size_t n_entry_bytes = get_entry_bytes(entry);
+		if (n_entry_bytes > byte_budget_) return;
+
+		std::lock_guard lock(mutex_);
+
+		// Replaces a concurrent insert of the same text, or a colliding one.
+		auto it = index_.find(entry.key);
+		if (it != index_.end()) erase(it->second);
+
+		while (!entries_.empty() && n_bytes_ + n_entry_bytes > byte_budget_) erase(std::prev(entries_.end()));
+
+		entries_.emplace_front(std::move(entry));
+		index_[entries_.front().key] = entries_.begin();
+		n_bytes_ += n_entry_bytes;
+	}
+
+	size_t TokenCache::get_bytes() const {
+		std::lock_guard lock(mutex_);
+		return n_bytes_;
+	}
+
+	uint64_t TokenCache::make_key(std::string_view text, bool add_special, bool parse_special) {
+		const uint64_t hash = std::hash<std::string_view>{}(text);
+		return (hash << 2) ^ (hash >> 62) ^ ((uint64_t)add_special << 1) ^ (uint64_t)parse_special;
+	}
+
+	size_t TokenCache::get_entry_bytes(const Entry& entry) {
+		return entry.text.size() + entry.tokens.size() * sizeof(llama_token) + entry_overhead_bytes;
+	}
+
+	void TokenCache::erase(std::list<Entry>::iterator it) {
+		n_bytes_ -= get_entry_bytes(*it);
+		index_.erase(it->key);
+		entries_.erase(it);
+	}
+
+}
@@ -1,9 +1,20 @@
 #include "model_server.h"
 #include "llama_model.h"
+#include "batch_engine.h"
+#include "context_pool.h"
+#include "llama_context.h"
+#include "request_scheduler.h"
+#include "grammar_cache.h"
+#include "token_cache.h"
+#include "media_cache.h"
+#include "embedding_cache.h"
+#include "utils.h"
 #include "llama_log.h"
 #include "llama.h"
 #include "mtmd.h"
 
+#include <chrono>
+#include <filesystem>
 #include <format>
 
 namespace llama_server {
@@ -14,7 +25,8 @@ namespace llama_server {
     // ModelServer
     // ===================================================================
 
-    ModelServer::ModelServer() {}
+    ModelServer::ModelServer()
+        : loader_pool_(std::make_unique<ThreadPool>(max_parallel_loads)) {}
     ModelServer::~ModelServer() {}
 
     ModelServer& ModelServer::get_server() {
@@ -29,19 +41,56 @@ namespace llama_server {
 
         std::unique_lock lock(mutex_);
 
+        // Queued loads fail on the flag, running ones finish and drop their model.
+        auto loader_pool = std::move(loader_pool_);
+
+        auto delete_engine_queue = std::move(engine_map_);
+        engine_map_.clear();
+        auto delete_pool_queue = std::move(context_pool_map_);
+        context_pool_map_.clear();
+        scheduler_map_.clear();
         auto delete_queue = std::move(model_map_);
         model_map_.clear();
+        config_map_.clear();
         loading_model_set_.clear();
         loading_model_cv_.notify_all();
 
         lock.unlock();
 
+        loader_pool.reset();
+
+        delete_engine_queue.clear();
+        delete_pool_queue.clear();
         delete_queue.clear();
     }
 
     void ModelServer::load_model(
         const ModelConfig& config,
         std::string name
+    ) {
+        load_model_async(config, std::move(name)).get();
+    }
+
+    std::shared_future<void> ModelServer::load_model_async(
+        const ModelConfig& config,
+        std::string name,
+        LoadProgressCallback progress_callback
+    ) {
+        std::shared_lock lock(mutex_);
+
+        if (shutdown_flag_ || !loader_pool_) {
+            throw ServerShutdownException("ModelServer is shutdown. Cannot load model: " + name);
+        }
+
+        return loader_pool_->submit([this, config, name = std::move(name), progress_callback = std::move(progress_callback)] {
+            load_model_impl(config, name, progress_callback);
+        }).share();
+    }
+
+    void ModelServer::load_model_impl(
+        const ModelConfig& config,
+        std::string name,
+        const LoadProgressCallback& progress_callback
     ) {
         if (shutdown_flag_) {
             throw ServerShutdownException("ModelServer is shutdown. Cannot load model: " + name);
@@ -65,20 +114,54 @@ namespace llama_server {
 
         loading_model_set_.emplace(name);
 
+        std::error_code ec;
+        size_t incoming_bytes = std::filesystem::file_size(config.model_path, ec);
+        if (!config.mtmd_path.empty()) incoming_bytes += std::filesystem::file_size(config.mtmd_path, ec);
+        auto evicted = evict_for(ec ? 0 : incoming_bytes, name);
+
         lock.unlock();
 
+        evicted.clear();
+
         llama_model_params model_params = llama_model_default_params();
         model_params.n_gpu_layers = config.n_gpu_layers;
         model_params.use_mmap = config.use_mmap;
         model_params.use_mlock = config.use_mlock;
+        if (progress_callback) {
+            model_params.progress_callback = [](float progress, void* user_data) {
+                return (*static_cast<const LoadProgressCallback*>(user_data))(progress);
+            };
+            model_params.progress_callback_user_data = const_cast<LoadProgressCallback*>(&progress_callback);
+        }
 
         mtmd_context_params mtmd_params = mtmd_context_params_default();
         mtmd_params.image_min_tokens = config.image_min_tokens;
         mtmd_params.image_max_tokens = config.image_max_tokens;
 
         std::shared_ptr<LlamaModel> model;
-
-        try { model = std::make_shared<LlamaModel>(config.model_path, model_params, config.mtmd_path, mtmd_params); }
+        std::shared_ptr<BatchEngine> engine;
+        std::shared_ptr<ContextPool> context_pool;
+
+        try {
+            model = std::make_shared<LlamaModel>(config.model_path, model_params, config.mtmd_path, mtmd_params,
+                config.media_cache_bytes, config.embedding_cache_bytes, config.embedding_cache_dir);
+
+            if (config.n_parallel > 0) {
+                llama_context_params engine_params = llama_context_default_params();
+                engine_params.n_ctx = config.batch_context.n_ctx;
+                engine_params.n_batch = config.batch_context.n_batch;
+                engine_params.n_ubatch = config.batch_context.n_ubatch;
+                engine_params.n_seq_max = config.n_parallel + config.prefix_cache_slots;
+                engine_params.kv_unified = true;
+
+                engine = std::make_shared<BatchEngine>(engine_params, model, config.prefix_cache_slots, config.prefix_cache_tokens);
+            }
+            else if (config.context_pool_max > 0) {
+                context_pool = std::make_shared<ContextPool>(model, config.context_pool_min, config.context_pool_max);
+            }
+
+            if (config.warmup) warm_up(config, model, engine);
+        }
         catch (const LlamaException& e) {
             log_error(e.what());
             lock.lock();
@@ -96,8 +179,59 @@ namespace llama_server {
         }
 
         loading_model_set_.erase(name);
-        model_map_.emplace(std::move(name), std::move(model));
+        if (engine) engine_map_.emplace(name, std::move(engine));
+        if (context_pool) context_pool_map_.emplace(name, std::move(context_pool));
+        if (config.max_active > 0) {
+            scheduler_map_.emplace(name, std::make_shared<RequestScheduler>(config.max_active, config.max_queued, config.queue_timeout));
+        }
+        config_map_.insert_or_assign(name, config);
+        model_map_.emplace(name, std::move(model));
         loading_model_cv_.notify_all();
+
+        // Contexts created with the model may have pushed the total over the budget.
+        evicted = evict_for(0, name);
+
+        lock.unlock();
+    }
+
+    void ModelServer::warm_up(
+        const ModelConfig& config,
+        const std::shared_ptr<LlamaModel>& model,
+        const std::shared_ptr<BatchEngine>& engine
+    ) {
+        auto start = std::chrono::steady_clock::now();
+
+        // Sequential read-ahead of the mapped file is much cheaper than the page faults of the first decode.
+        std::future<void> prefetch;
+        if (config.use_mmap) {
+            prefetch = std::async(std::launch::async, [path = config.model_path] { prefetch_file(path); });
+        }
+
+        bool decoded = false;
+        try {
+            if (engine) {
+                // Reserve only the dummy tokens, the engine cells may already be held by prefix slots.
+                LlamaContext(engine, 8).warm_up();
+            }
+            else {
+                llama_context_params params = llama_context_default_params();
+                params.n_ctx = 512;
+                params.n_batch = 512;
+                params.n_ubatch = 512;
+                LlamaContext(params, model).warm_up();
+            }
+            decoded = true;
+        }
+        catch (const LlamaException& e) {
+            log_warn(std::format("ModelServer: Warm-up decode failed: {}", e.what()));
+        }
+
+        if (prefetch.valid()) prefetch.wait();
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        model->set_warmup(ms, decoded);
+        if (decoded) log_info(std::format("ModelServer: Warmed up model {} in {:.0f} ms", config.model_path, ms));
+        else log_info(std::format("ModelServer: Prefetched model {} in {:.0f} ms without a warm-up decode", config.model_path, ms));
     }
 
     void ModelServer::unload_model(
@@ -117,13 +251,64 @@ namespace llama_server {
             throw UnloadWhenLoadingModelException("Model is loading, try unload after loading is done: " + name);
         }
 
+        engine_map_.erase(name);
+        context_pool_map_.erase(name);
+        scheduler_map_.erase(name);
         model_map_.erase(name);
+        config_map_.erase(name);
+    }
+
+    void ModelServer::set_memory_budget(size_t bytes) {
+        std::unique_lock lock(mutex_);
+
+        memory_budget_ = bytes;
+        auto evicted = evict_for(0, "");
+
+        lock.unlock();
+    }
+
+    std::vector<std::shared_ptr<void>> ModelServer::evict_for(size_t incoming_bytes, const std::string& keep) {
+        std::vector<std::shared_ptr<void>> evicted;
+        if (memory_budget_ == 0) return evicted;
+
+        while (true) {
+            size_t used = incoming_bytes;
+            for (auto& [name, model] : model_map_) used += model->get_footprint();
+            if (used <= memory_budget_) break;
+
+            auto victim = model_map_.end();
+            for (auto it = model_map_.begin(); it != model_map_.end(); ++it) {
+                if (it->first == keep || it->second->get_n_sessions() > 0) continue;
+                if (victim == model_map_.end() || it->second->get_last_used() < victim->second->get_last_used()) victim = it;
+            }
+
+            if (victim == model_map_.end()) {
+                log_warn(std::format("ModelServer: Memory budget exceeded by {} bytes, no idle model to evict.", used - memory_budget_));
+                break;
+            }
+
+            log_info(std::format("ModelServer: Evicting model: {}", victim->first));
+
+            if (auto engine = engine_map_.find(victim->first); engine != engine_map_.end()) {
+                evicted.emplace_back(std::move(engine->second));
+                engine_map_.erase(engine);
+            }
+            if (auto pool = context_pool_map_.find(victim->first); pool != context_pool_map_.end()) {
+                evicted.emplace_back(std::move(pool->second));
+                context_pool_map_.erase(pool);
+            }
+            scheduler_map_.erase(victim->first);
+            evicted.emplace_back(std::move(victim->second));
+            model_map_.erase(victim);
+        }
+
+        return evicted;
     }
 
     std::unique_ptr<LlamaSession> ModelServer::get_session(
         std::string model_name,
         ContextConfig context_config
-    ) const {
+    ) {
         std::shared_lock lock(mutex_);
 
         if (shutdown_flag_) {
@@ -141,10 +326,117 @@ namespace llama_server {
         }
 
         if (model == model_map_.end()) {
+            auto config = config_map_.find(model_name);
+            if (config == config_map_.end()) {
+                throw LlamaException("Model not found: " + model_name);
+            }
+
+            // Evicted by the memory budget, reload transparently.
+            ModelConfig model_config = config->second;
+            lock.unlock();
+
+            log_info(std::format("ModelServer: Reloading evicted model: {}", model_name));
+            load_model(model_config, model_name);
+
+            return get_session(std::move(model_name), context_config);
+        }
+
+        model->second->touch();
+
+        std::unique_ptr<LlamaSession> session;
+        if (auto engine = engine_map_.find(model_name); engine != engine_map_.end()) {
+            session = std::make_unique<LlamaSession>(context_config, engine->second);
+        }
+        else if (auto pool = context_pool_map_.find(model_name); pool != context_pool_map_.end()) {
+            session = std::make_unique<LlamaSession>(context_config, pool->second);
+        }
+        else {
+            session = std::make_unique<LlamaSession>(context_config, model->second);
+        }
+
+        if (auto scheduler = scheduler_map_.find(model_name); scheduler != scheduler_map_.end()) {
+            session->set_scheduler(scheduler->second);
+        }
+
+        const std::string& draft_name = config_map_.at(model_name).draft_model;
+        if (!draft_name.empty()) {
+            if (auto draft = model_map_.find(draft_name); draft != model_map_.end()) {
+                session->set_draft_model(draft->second);
+            }
+            else {
+                log_warn(std::format("ModelServer: Draft model {} is not loaded, speculative decoding disabled.", draft_name));
+            }
+        }
+
+        return session;
+    }
+
+    void ModelServer::prewarm_contexts(
+        std::string model_name,
+        ContextConfig context_config
+    ) const {
+        std::shared_lock lock(mutex_);
+
+        if (shutdown_flag_) {
+            throw ServerShutdownException("ModelServer is shutdown. Cannot prewarm contexts.");
+        }
+
+        auto pool = context_pool_map_.find(model_name);
+        if (pool == context_pool_map_.end()) {
+            log_warn(std::format("ModelServer: Context pool is disabled for model: {}", model_name));
+            return;
+        }
+
+        std::shared_ptr<ContextPool> context_pool = pool->second;
+        lock.unlock();
+
+        context_pool->prewarm(context_config);
+    }
+
+    ModelStats ModelServer::get_model_stats(std::string model_name) const {
+        std::shared_lock lock(mutex_);
+
+        if (config_map_.find(model_name) == config_map_.end()) {
             throw LlamaException("Model not found: " + model_name);
         }
 
-        return std::make_unique<LlamaSession>(context_config, model->second);
+        ModelStats stats;
+
+        if (auto model = model_map_.find(model_name); model != model_map_.end()) {
+            stats.resident = true;
+            stats.memory_bytes = model->second->get_footprint();
+            stats.warmup_ms = model->second->get_warmup_ms();
+            stats.warmed_up = model->second->is_warmed_up();
+            stats.draft_tokens = model->second->get_n_drafted();
+            stats.draft_accepted = model->second->get_n_accepted();
+            stats.lookup_tokens = model->second->get_n_lookup_drafted();
+            stats.lookup_accepted = model->second->get_n_lookup_accepted();
+            stats.grammar_cache_hits = model->second->get_grammar_cache().get_hits();
+            stats.grammar_cache_misses = model->second->get_grammar_cache().get_misses();
+            stats.token_cache_hits = model->second->get_token_cache().get_hits();
+            stats.token_cache_misses = model->second->get_token_cache().get_misses();
+            stats.media_cache_hits = model->second->get_media_cache().get_hits();
+            stats.media_cache_misses = model->second->get_media_cache().get_misses();
+            stats.media_cache_bytes = model->second->get_media_cache().get_bytes();
+            if (model->second->get_mtmd()) {
+                stats.embedding_cache_hits = model->second->get_embedding_cache().get_hits();
+                stats.embedding_cache_disk_hits = model->second->get_embedding_cache().get_disk_hits();
+                stats.embedding_cache_misses = model->second->get_embedding_cache().get_misses();
+            }
+        }
+
+        if (auto scheduler = scheduler_map_.find(model_name); scheduler != scheduler_map_.end()) {
+            stats.requests_rejected = scheduler->second->get_rejected();
+            stats.requests_timed_out = scheduler->second->get_timed_out();
+            stats.preemptions = scheduler->second->get_preempted();
+        }
+
+        if (auto pool = context_pool_map_.find(model_name); pool != context_pool_map_.end()) {
+            stats.context_pool_hits = pool->second->get_hits();
+            stats.context_pool_misses = pool->second->get_misses();
+        }
+
+        return stats;
     }
 
 }
\ No newline at end of file
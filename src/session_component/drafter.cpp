@@ -0,0 +1,67 @@
+#include "drafter.h"
+#include "llama_model.h"
+#include "llama_context.h"
+
+#include <algorithm>
+
+namespace llama_server::internal {
+
+	Drafter::Drafter(std::shared_ptr<LlamaModel> model, uint32_t n_ctx) {
+		llama_context_params params = llama_context_default_params();
+		params.n_ctx = n_ctx;
+
+		context_ = std::make_unique<LlamaContext>(params, model);
+		model_lease_ = model->lease_session();
+	}
+
+	Drafter::~Drafter() = default;
+
+	bool Drafter::is_compatible(const LlamaModel& target, const LlamaModel& draft) {
+		const llama_vocab* target_vocab = target.get_vocab();
+		const llama_vocab* draft_vocab = draft.get_vocab();
+
+		return llama_vocab_type(target_vocab) == llama_vocab_type(draft_vocab)
+			&& llama_vocab_n_tokens(target_vocab) == llama_vocab_n_tokens(draft_vocab)
+			&& llama_vocab_bos(target_vocab) == llama_vocab_bos(draft_vocab)
+			&& llama_vocab_eos(target_vocab) == llama_vocab_eos(draft_vocab);
+	}
+
+	std::vector<llama_token> Drafter::draft(std::span<const llama_token> tokens, size_t n_draft) {
+		std::vector<llama_token> drafted;
+		if (tokens.empty() || n_draft == 0) return drafted;
+		if (tokens.size() + n_draft > context_->get_n_ctx()) return drafted;
+
+		size_t n_keep = 0;
+		while (n_keep < tokens_.size() && n_keep < tokens.size() && tokens_[n_keep] == tokens[n_keep]) n_keep++;
+		// The last token is decoded again for its logits.
+		n_keep = std::min(n_keep, tokens.size() - 1);
+
+		try {
+			context_->KV_cleanup((int32_t)n_keep);
+			tokens_.resize(n_keep);
+
+			context_->text_prefill(tokens.data() + n_keep, tokens.size() - n_keep, true);
+			tokens_.insert(tokens_.end(), tokens.begin() + n_keep, tokens.end());
+
+			const size_t n_vocab = context_->get_n_vocab();
+			while (true) {
+				const float* logits = context_->get_logits();
+				llama_token token = (llama_token)(std::max_element(logits, logits + n_vocab) - logits);
+
+				drafted.emplace_back(token);
+				if (drafted.size() == n_draft || llama_vocab_is_eog(context_->get_vocab(), token)) break;
+
+				context_->step(token);
+				tokens_.emplace_back(token);
+			}
+		}
+		catch (const LlamaException&) {
+			// The KV no longer matches tokens_, the next draft starts over.
+			tokens_.clear();
+			throw;
+		}
+
+		return drafted;
+	}
+
+}
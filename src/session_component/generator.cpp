@@ -0,0 +1,346 @@
+#include "generator.h"
+#include "llama_log.h"
+#include "llama_context.h"
+#include "llama_model.h"
+#include "tokenizer.h"
+#include "sampler.h"
+#include "streamer.h"
+#include "drafter.h"
+#include "prompt_lookup.h"
+#include "request_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+
+namespace llama_server::internal {
+
+	Generator::Generator(LlamaContext& context, Sampler& sampler, const Tokenizer& tokenizer, Streamer& streamer)
+		: context_(context), sampler_(sampler), tokenizer_(tokenizer), streamer_(streamer) {}
+
+	Generator::~Generator() { stop(); }
+
+	void Generator::start(
+		std::span<IDChunksPtr const> chunks,
+		const GenConfig& gen_config,
+		size_t max_tokens,
+		Drafter* drafter,
+		std::unique_ptr<SchedulerTicket> ticket
+	) {
+		stop();
+
+		max_tokens_ = max_tokens;
+		n_generated_ = 0;
+		n_drafted_ = 0;
+		n_accepted_ = 0;
+		n_jumped_ = 0;
+		n_draft_ = gen_config.n_draft;
+		jump_forward_ = gen_config.jump_forward;
+		stop_tokens_.assign(gen_config.stop.tokens.begin(), gen_config.stop.tokens.end());
+		streamer_.set_stop(gen_config.stop.strings);
+		buffer_.clear();
+		output_.clear();
+		history_.clear();
+		ticket_ = std::move(ticket);
+		finished_ = false;
+
+		// The draft model only sees text, media prompts fall back to prompt lookup which only searches text.
+		const bool all_text = std::ranges::all_of(chunks, [](const IDChunksPtr& chunk) { return chunk->type == TEXT; });
+		drafter_ = n_draft_ > 0 && all_text ? drafter : nullptr;
+		lookup_ = !drafter_ && n_draft_ > 0 && gen_config.lookup_ngram > 0
+			? std::make_unique<PromptLookup>(gen_config.lookup_ngram)
+			: nullptr;
+
+		if (drafter_ || lookup_) {
+			for (auto& chunk : chunks) history_.insert(history_.end(), chunk->text_tokens.begin(), chunk->text_tokens.end());
+		}
+
+		accept(sampler_.apply());
+	}
+
+	void Generator::queue(std::unique_ptr<SchedulerTicket> ticket, std::function<void(std::unique_ptr<SchedulerTicket>)> launch) {
+		stop();
+
+		ticket_ = std::move(ticket);
+		launch_ = std::move(launch);
+		finished_ = false;
+	}
+
+	bool Generator::step(bool block) {
+		if (finished_) return false;
+
+		if (launch_) {
+			auto abort_check = [this] { return context_.is_abort_requested(); };
+			auto admission = block ? ticket_->wait(abort_check) : ticket_->poll(abort_check);
+
+			if (admission == SchedulerTicket::Admission::QUEUED) return false;
+			if (admission == SchedulerTicket::Admission::DROPPED) {
+				log_warn("Generation was not admitted.");
+				finish();
+				return true;
+			}
+
+			// start runs from launch, unless the prefill fails the generation stays finished.
+			auto launch = std::move(launch_);
+			launch_ = nullptr;
+			finished_ = true;
+			launch(std::move(ticket_));
+			return true;
+		}
+
+		if (paused_) {
+			auto abort_check = [this] { return context_.is_abort_requested(); };
+			auto admission = block ? ticket_->wait(abort_check) : ticket_->poll(abort_check);
+
+			if (admission == SchedulerTicket::Admission::QUEUED) return false;
+			if (admission == SchedulerTicket::Admission::DROPPED) {
+				log_info("Generation dropped while preempted");
+				finish();
+				return true;
+			}
+
+			try { resume(); }
+			catch (const LlamaException& e) {
+				log_error(e.what());
+				finish();
+				return true;
+			}
+		}
+
+		if (!pending_.valid()) {
+			if (context_.is_abort_requested()) {
+				log_info("Generation cancelled");
+				finish();
+				return true;
+			}
+
+			if (n_generated_ >= max_tokens_) {
+				finish();
+				return true;
+			}
+
+			if (ticket_ && ticket_->should_yield()) {
+				try { pause(); }
+				catch (const LlamaException& e) {
+					log_error(e.what());
+					finish();
+					return true;
+				}
+				return step(block);
+			}
+
+			if (jump_forward_ && jump()) return true;
+			if ((drafter_ || lookup_) && speculate()) return true;
+
+			pending_ = context_.step_async(next_token_);
+		}
+
+		if (!block && pending_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return false;
+
+		try { pending_.get(); }
+		catch (const DecodeAbortedException&) {
+			log_info("Generation cancelled");
+			finish();
+			return true;
+		}
+		catch (const LlamaException& e) {
+			log_error(e.what());
+			finish();
+			return true;
+		}
+
+		accept(sampler_.apply());
+		return true;
+	}
+
+	void Generator::stop() {
+		if (pending_.valid()) {
+			try { pending_.get(); }
+			catch (const LlamaException&) {}
+		}
+
+		finish();
+		output_.clear();
+	}
+
+	std::string Generator::pop_output() {
+		std::string piece = std::move(output_.front());
+		output_.pop_front();
+		return piece;
+	}
+
+	bool Generator::accept(llama_token token) {
+		next_token_ = token;
+		n_generated_++;
+
+		if (llama_vocab_is_eog(context_.get_vocab(), token)) {
+			log_info("\nEnd of generation");
+			finish();
+			return false;
+		}
+
+		buffer_ += tokenizer_.get_piece(token);
+		const bool matched = !streamer_.process(buffer_, [this](std::string&& piece) {
+			output_.emplace_back(std::move(piece));
+			return true;
+		});
+
+		if (matched || std::ranges::find(stop_tokens_, token) != stop_tokens_.end()) {
+			log_info("\nStop sequence reached");
+			finish();
+			return false;
+		}
+
+		if (n_generated_ >= max_tokens_) {
+			finish();
+			return false;
+		}
+
+		if (drafter_ || lookup_) history_.emplace_back(token);
+		return true;
+	}
+
+	bool Generator::jump() {
+		const size_t n_past = context_.get_used_memory();
+		const size_t n_room = context_.get_n_ctx() - std::min(context_.get_n_ctx(), n_past + 1);
+		const size_t n_max = std::min(max_tokens_ - n_generated_, n_room);
+		if (n_max == 0) return false;
+
+		std::vector<llama_token> forced = sampler_.jump_forward(n_max);
+		if (forced.empty()) return false;
+
+		std::vector<llama_token> batch = { next_token_ };
+		batch.insert(batch.end(), forced.begin(), forced.end());
+
+		n_jumped_ += forced.size();
+		for (llama_token token : forced) {
+			if (!accept(token)) return true;
+		}
+
+		// The forced tokens are decoded together, the logits of the last one give the next sampled token.
+		try { context_.text_prefill(batch, true); }
+		catch (const DecodeAbortedException&) {
+			log_info("Generation cancelled");
+			finish();
+			return true;
+		}
+		catch (const LlamaException& e) {
+			log_error(e.what());
+			finish();
+			return true;
+		}
+
+		accept(sampler_.apply());
+		return true;
+	}
+
+	bool Generator::speculate() {
+		const size_t n_past = context_.get_used_memory();
+		const size_t n_room = std::min(
+			context_.get_n_ctx() - std::min(context_.get_n_ctx(), n_past + 1),
+			(size_t)llama_n_batch(context_.get_data()) - 1
+		);
+		const size_t n_draft = std::min({ (size_t)n_draft_, max_tokens_ - n_generated_ - 1, n_room });
+		if (n_draft == 0) return false;
+
+		std::vector<llama_token> drafted;
+		try { drafted = lookup_ ? lookup_->draft(history_, n_draft) : drafter_->draft(history_, n_draft); }
+		catch (const LlamaException& e) {
+			log_warn(std::format("Speculative decoding disabled: {}", e.what()));
+			drafter_ = nullptr;
+			return false;
+		}
+		if (drafted.empty()) return false;
+
+		// Verify all proposals in one batch, every position is sampled as if decoded one by one.
+		std::vector<llama_token> batch = { next_token_ };
+		batch.insert(batch.end(), drafted.begin(), drafted.end());
+
+		try { context_.text_prefill_all(batch); }
+		catch (const DecodeAbortedException&) {
+			log_info("Generation cancelled");
+			finish();
+			return true;
+		}
+		catch (const LlamaException& e) {
+			log_error(e.what());
+			finish();
+			return true;
+		}
+
+		size_t n_accept = 0;
+		for (size_t i = 0; i <= drafted.size(); i++) {
+			llama_token token = sampler_.apply(context_.get_logits(i));
+			const bool agreed = i < drafted.size() && token == drafted[i];
+
+			if (!accept(token)) break;
+			if (!agreed) break;
+			n_accept++;
+		}
+
+		n_drafted_ += drafted.size();
+		n_accepted_ += n_accept;
+		if (lookup_) context_.get_model().record_lookup(drafted.size(), n_accept);
+		else context_.get_model().record_speculation(drafted.size(), n_accept);
+
+		if (finished_) return true;
+
+		// Drop the rejected suffix, next_token_ is the correction and is decoded next.
+		try { context_.KV_cleanup((int32_t)(n_past + 1 + n_accept)); }
+		catch (const LlamaException& e) {
+			log_error(e.what());
+			finish();
+		}
+
+		return true;
+	}
+
+	void Generator::pause() {
+		if (context_.is_shared()) {
+			snapshot_ = context_.get_state();
+			context_.KV_cleanup(0);
+		}
+
+		ticket_->yield();
+		paused_ = true;
+		log_info("Generation preempted");
+	}
+
+	void Generator::resume() {
+		paused_ = false;
+
+		if (!snapshot_.empty()) {
+			context_.set_state(snapshot_);
+			snapshot_.clear();
+		}
+	}
+
+	void Generator::finish() {
+		if (finished_) return;
+		finished_ = true;
+		paused_ = false;
+		launch_ = nullptr;
+		ticket_.reset();
+
+		// Text held back as a possible start of a stop string turned out to be plain output.
+		streamer_.flush([this](std::string&& piece) {
+			output_.emplace_back(std::move(piece));
+			return true;
+		});
+
+		// Put the prompt back so the next request reuses it.
+		if (!snapshot_.empty()) {
+			try { context_.set_state(snapshot_); }
+			catch (const LlamaException& e) { log_warn(std::format("Failed to restore preempted state: {}", e.what())); }
+			snapshot_.clear();
+		}
+
+		if (n_jumped_ > 0) {
+			log_info(std::format("Jump-forward: {} tokens forced by the grammar", n_jumped_));
+		}
+		if (n_drafted_ > 0) {
+			log_info(std::format("Speculative decoding ({}): accepted {}/{} drafted tokens", lookup_ ? "prompt lookup" : "draft model", n_accepted_, n_drafted_));
+		}
+	}
+
+}
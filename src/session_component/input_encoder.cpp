@@ -5,58 +5,105 @@
 #include "llama_model.h"
 #include "templater.h"
 #include "tokenizer.h"
+#include "media_encoder.h"
 #include "mtmd.h"
-#include "mtmd-helper.h"
 
 #include <re2/re2.h>
+#include <format>
 #include <string>
 #include <ranges>
 
 namespace llama_server::internal {
 
-	using namespace input_encoder_detail;
-
 	namespace input_encoder_detail {
 
-		const re2::RE2 capture_path{ R"(<__path:(.*?)__>)" };
+		// Group 1 is the kind of reference, "path" or "media", group 2 the path or handle.
+		const re2::RE2 capture_media{ R"(<__(path|media):(.*?)__>)" };
 
 		common_chat_msg guard_prompt = { .role = "system", .content = "This is a guard to prevent tokens exceeding the context length." };
 
 		std::vector<common_chat_tool> empty_tools;
 		mtmd::bitmaps empty_bitmaps;
 
-		class MediaHelper {
-		public:
-			MediaHelper(const LlamaModel& model)
-				: model_(model) {
-			}
-			~MediaHelper() = default;
+		// Clears the container when the scope ends, however it ends.
+		template <typename T>
+		struct ClearOnExit {
+			T& container;
+			~ClearOnExit() { container.clear(); }
+		};
 
-			std::unique_ptr<mtmd::bitmaps> load_media(std::string_view path) {
-				std::string path_str(path);
+		// Estimates not used by the last two turns are dropped beyond this many entries.
+		constexpr size_t max_estimate_entries = 4096;
 
-				std::unique_ptr<mtmd::bitmaps> result = std::make_unique<mtmd::bitmaps>();
+		inline uint64_t hash_combine(uint64_t seed, std::string_view value) {
+			return seed ^ (std::hash<std::string_view>{}(value) + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+		}
 
-				mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_file(model_.get_mtmd(), path_str.data()));
-				if (!bmp.ptr) throw llama_server::LlamaException(std::format("Failed to load media from file: {}", path_str));
-				result->entries.emplace_back(std::move(bmp));
+		uint64_t hash_message(const common_chat_msg& msg) {
+			uint64_t hash = hash_combine(0, "message");
+			hash = hash_combine(hash, msg.role);
+			hash = hash_combine(hash, msg.content);
+			for (const auto& part : msg.content_parts) {
+				hash = hash_combine(hash, part.type);
+				hash = hash_combine(hash, part.text);
+			}
+			for (const auto& tool_call : msg.tool_calls) {
+				hash = hash_combine(hash, tool_call.name);
+				hash = hash_combine(hash, tool_call.arguments);
+				hash = hash_combine(hash, tool_call.id);
+			}
+			hash = hash_combine(hash, msg.reasoning_content);
+			hash = hash_combine(hash, msg.tool_name);
+			hash = hash_combine(hash, msg.tool_call_id);
+			return hash;
+		}
 
-				return result;
+		uint64_t hash_tools(const std::vector<common_chat_tool>& tools) {
+			uint64_t hash = hash_combine(0, "tools");
+			for (const auto& tool : tools) {
+				hash = hash_combine(hash, tool.name);
+				hash = hash_combine(hash, tool.description);
+				hash = hash_combine(hash, tool.parameters);
 			}
-		private:
-			const LlamaModel& model_;
-		};
+			return hash;
+		}
+
+		// Starts loading every media of prompt in parallel, in order of appearance.
+		std::vector<std::future<IDChunksPtr>> load_all_media(
+			MediaEncoder& encoder,
+			std::string_view prompt,
+			const std::unordered_map<std::string, MediaBuffer>& media
+		) {
+			std::vector<std::future<IDChunksPtr>> result;
+
+			re2::StringPiece sp(prompt.data(), prompt.size());
+			re2::StringPiece match[3];
+			while (capture_media.Match(sp, 0, sp.size(), re2::RE2::UNANCHORED, match, 3)) {
+				std::string_view reference(match[2].data(), match[2].size());
+
+				if (match[1] == "path") result.emplace_back(encoder.load(reference));
+				else {
+					auto it = media.find(std::string(reference));
+					if (it == media.end()) throw LlamaException(std::format("Unknown media handle: {}", reference));
+					result.emplace_back(encoder.load(it->second));
+				}
+
+				sp.remove_prefix(match[0].data() - sp.data() + match[0].size());
+			}
+
+			return result;
+		}
 
 	}
 
+	using namespace input_encoder_detail;
+
 	InputEncoder::InputEncoder(
 		const LlamaContext& context,
 		const Templater& templater,
 		const Tokenizer& tokenizer,
 		TokenEstimateStrategy&& token_estimate_strategy
-	) : context_(context), templater_(templater), tokenizer_(tokenizer), token_estimate_strategy_(std::move(token_estimate_strategy)) {
-		media_helper_ = std::make_unique<MediaHelper>(context_.get_model());
-	}
+	) : context_(context), templater_(templater), tokenizer_(tokenizer), token_estimate_strategy_(std::move(token_estimate_strategy)) {}
 	
 	InputEncoder::~InputEncoder() = default;
 
@@ -66,7 +113,8 @@ namespace llama_server::internal {
 		std::vector<common_chat_tool>&& tools,
 		size_t max_tokens
 	) {
-		if (image_chunks_cache_.size() > 16) image_chunks_cache_.clear(); // Temporary simple cache eviction
+		// Do not keep the caller's buffers alive past the call.
+		ClearOnExit<decltype(media_)> media_guard{ media_ };
 
 		common_chat_templates_inputs input = prune_with_precache(std::move(head_msgs), std::move(tail_msgs), std::move(tools), max_tokens);
 		chat_params_cache_ = templater_(input);
@@ -77,27 +125,21 @@ namespace llama_server::internal {
 			auto text_tokens = tokenizer_.text_tokenize(text, false);
 			result.emplace_back(std::make_shared<IDChunks>(std::move(text_tokens)));
 		};
-		auto add_media = [&result, this](std::string_view path) {
-			auto it = image_chunks_cache_.find(path);
+		std::vector<std::future<IDChunksPtr>> loads;
+		if (context_.is_mtmd()) loads = load_all_media(context_.get_model().get_media_encoder(), chat_params_cache_.prompt, media_);
+		size_t media_idx = 0;
 
-			if (it == image_chunks_cache_.end()) {
-				std::unique_ptr<mtmd::bitmaps> bitmaps_ptr = media_helper_->load_media(path);
-
-				auto chunks = tokenizer_.mtmd_tokenize(mtmd_default_marker(), *bitmaps_ptr, false);
-				// Store chunk in cache
-				it = image_chunks_cache_.emplace(std::make_shared<IDChunks>(std::string(path), std::move(chunks))).first;
-			}
-
-			result.emplace_back(*it);
+		auto add_media = [&result, &loads, &media_idx]() {
+			result.emplace_back(loads.at(media_idx++).get());
 		};
 
 		re2::StringPiece sp(chat_params_cache_.prompt.data(), chat_params_cache_.prompt.size());
-		re2::StringPiece match[2]; // match[0] = full match, match[1] = capture group
-		while (capture_path.Match(sp, 0, sp.size(), re2::RE2::UNANCHORED, match, 2)) {
+		re2::StringPiece match[3]; // match[0] = full match, match[1] = reference kind, match[2] = path or handle
+		while (capture_media.Match(sp, 0, sp.size(), re2::RE2::UNANCHORED, match, 3)) {
 			size_t prefix_len = match[0].data() - sp.data();
 
 			if (prefix_len) add_text(std::string_view(sp.data(), prefix_len));
-			add_media(std::string_view(match[1].data(), match[1].size()));
+			add_media();
 
 			sp.remove_prefix(prefix_len + match[0].size());
 		}
@@ -107,6 +149,38 @@ namespace llama_server::internal {
 		return result;
 	}
 
+	std::string InputEncoder::bind_media(std::string content, std::vector<Media>&& media) {
+		if (media.empty()) return content;
+
+		// Handles are scoped to their message, in the prompt they become content ids which also key the token estimates.
+		std::unordered_map<std::string, std::string> ids;
+		for (auto& entry : media) {
+			std::string handle = entry.handle;
+			MediaBuffer buffer = MediaEncoder::make_buffer(std::move(entry));
+			if (!ids.emplace(handle, buffer.id).second) throw LlamaException(std::format("Duplicate media handle in a message: {}", handle));
+
+			std::string id = buffer.id;
+			media_.try_emplace(std::move(id), std::move(buffer));
+		}
+
+		std::string result;
+		re2::StringPiece sp(content.data(), content.size());
+		re2::StringPiece match[3];
+		while (capture_media.Match(sp, 0, sp.size(), re2::RE2::UNANCHORED, match, 3)) {
+			size_t prefix_len = match[0].data() - sp.data();
+			result.append(sp.data(), prefix_len);
+
+			auto it = ids.find(std::string(match[2].data(), match[2].size()));
+			if (match[1] == "media" && it != ids.end()) result += std::format("<__media:{}__>", it->second);
+			else result.append(match[0].data(), match[0].size());
+
+			sp.remove_prefix(prefix_len + match[0].size());
+		}
+		result.append(sp.data(), sp.size());
+
+		return result;
+	}
+
 	size_t InputEncoder::get_used_messages_cache() { return used_messages_cache_; }
 	common_chat_params InputEncoder::get_chat_params_cache() { return std::move(chat_params_cache_); }
 
@@ -115,24 +189,17 @@ namespace llama_server::internal {
 	size_t InputEncoder::estimate_mtmd_tokens(std::string_view str) {
 		size_t n_tokens = 0;
 
+		std::vector<std::future<IDChunksPtr>> media = load_all_media(context_.get_model().get_media_encoder(), str, media_);
+		size_t media_idx = 0;
+
 		re2::StringPiece sp(str);
-		re2::StringPiece match[2]; // match[0] = full match, match[1] = capture group
-		while (capture_path.Match(sp, 0, sp.size(), re2::RE2::UNANCHORED, match, 2)) {
+		re2::StringPiece match[3]; // match[0] = full match, match[1] = reference kind, match[2] = path or handle
+		while (capture_media.Match(sp, 0, sp.size(), re2::RE2::UNANCHORED, match, 3)) {
 			size_t prefix_len = match[0].data() - sp.data();
 
 			if (prefix_len) n_tokens += tokenizer_.text_tokenize(std::string_view(sp.data(), prefix_len)).size();
 
-			std::string_view path(match[1].data(), match[1].size());
-			auto it = image_chunks_cache_.find(path);
-			if (it == image_chunks_cache_.end()) {
-				std::unique_ptr<mtmd::bitmaps> bitmaps_ptr = media_helper_->load_media(path);
-
-				auto chunks = tokenizer_.mtmd_tokenize(mtmd_default_marker(), *bitmaps_ptr, false);
-				// Store chunk in cache
-				it = image_chunks_cache_.emplace(std::make_shared<IDChunks>(std::string(path), std::move(chunks))).first;
-			}
-
-			n_tokens += (*it)->n_tokens;
+			n_tokens += media[media_idx++].get()->n_tokens;
 
 			sp.remove_prefix(prefix_len + match[0].size());
 		}
@@ -142,6 +209,18 @@ namespace llama_server::internal {
 		return n_tokens;
 	}
 
+	size_t InputEncoder::estimate_cached(uint64_t key, const std::function<size_t()>& render) {
+		auto it = estimate_cache_.find(key);
+		if (it != estimate_cache_.end()) {
+			it->second.last_pass = estimate_pass_;
+			return it->second.n_tokens;
+		}
+
+		size_t n_tokens = render();
+		estimate_cache_.emplace(key, Estimate{ .n_tokens = n_tokens, .last_pass = estimate_pass_ });
+		return n_tokens;
+	}
+
 	common_chat_templates_inputs InputEncoder::prune_with_precache(
 		std::vector<common_chat_msg>&& head_msgs,
 		std::vector<common_chat_msg>&& tail_msgs,
@@ -156,26 +235,30 @@ namespace llama_server::internal {
 		common_chat_templates_inputs temporary_inputs = { .messages = std::vector<common_chat_msg>(1), .add_generation_prompt = false };
 		size_t n_cap = context_.get_n_ctx() - max_tokens;
 
+		estimate_pass_++;
+		if (estimate_cache_.size() > max_estimate_entries) {
+			std::erase_if(estimate_cache_, [this](const auto& entry) { return entry.second.last_pass + 2 < estimate_pass_; });
+		}
+
 		size_t n_tokens = token_estimate_strategy_.margin_;
-		{
-			
+		n_tokens += estimate_cached(hash_tools(tools), [&] {
 			LoanGuard messages_guard(guard_prompt, temporary_inputs.messages[0]);
 			LoanGuard tools_guard(tools, temporary_inputs.tools);
 
 			common_chat_params params = templater_(temporary_inputs);
-			n_tokens += token_estimate_strategy_.estimate(tokenize_callback, params.prompt);
-		}
+			return token_estimate_strategy_.estimate(tokenize_callback, params.prompt);
+		});
 
 		if (n_tokens > n_cap) { throw llama_server::LlamaException("Too many tools tokens"); }
 		result.tools = std::move(tools);
 
 		for (auto& head_msg : head_msgs) {
-			{
+			n_tokens += estimate_cached(hash_message(head_msg), [&] {
 				LoanGuard message_guard(head_msg, temporary_inputs.messages[0]);
 
 				common_chat_params params = templater_(temporary_inputs);
-				n_tokens += token_estimate_strategy_.estimate(tokenize_callback, params.prompt);
-			}
+				return token_estimate_strategy_.estimate(tokenize_callback, params.prompt);
+			});
 			if (n_tokens > n_cap) {
 				log_warn("Too many head messages tokens, dropping messages.");
 				return result;
@@ -186,12 +269,12 @@ namespace llama_server::internal {
 
 		std::vector<common_chat_msg> reverse_queue;
 		for (auto& tail_msg : tail_msgs | std::views::reverse) {
-			{
+			n_tokens += estimate_cached(hash_message(tail_msg), [&] {
 				LoanGuard message_guard(tail_msg, temporary_inputs.messages[0]);
 
 				common_chat_params params = templater_(temporary_inputs);
-				n_tokens += token_estimate_strategy_.estimate(tokenize_callback, params.prompt);
-			}
+				return token_estimate_strategy_.estimate(tokenize_callback, params.prompt);
+			});
 			if (n_tokens > n_cap) break;
 
 			reverse_queue.emplace_back(std::move(tail_msg));
@@ -1,14 +1,54 @@
 #include "kv_scheduler.h"
 #include "llama_log.h"
 #include "llama_context.h"
+#include "llama_model.h"
 #include "llama.h"
+#include "mtmd.h"
 
 #include <ranges>
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <cstring>
 
 namespace llama_server::internal {
 
-	KVScheduler::KVScheduler(LlamaContext& context)
-		: context_(context) {
+	namespace kv_scheduler_detail {
+
+		constexpr char state_magic[8] = { 'L', 'S', 'K', 'V', 'S', 'T', 'A', 'T' };
+		constexpr uint32_t state_version = 2;
+		constexpr uint64_t state_alignment = 4096;
+
+		// Every section starts at an offset aligned for its content, so the file can be mapped as-is.
+		struct StateHeader {
+			char magic[8];
+			uint32_t version;
+			uint32_t n_vocab;
+			uint64_t n_tokens;			// KV positions held by the sequence
+			uint64_t n_chunks;
+			uint64_t chunks_offset;		// StateChunk[n_chunks]
+			uint64_t data_offset;		// ids and tokens of the chunks
+			uint64_t data_size;
+			uint64_t state_offset;		// llama sequence state, page aligned
+			uint64_t state_size;
+		};
+
+		struct StateChunk {
+			uint32_t type;
+			uint32_t id_size;
+			uint64_t id_offset;			// relative to data_offset
+			uint64_t tokens_offset;		// relative to data_offset, aligned to llama_token
+			uint64_t n_tokens;			// text tokens, or KV positions of a media chunk
+		};
+
+		inline uint64_t align_up(uint64_t value, uint64_t alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+	}
+
+	using namespace kv_scheduler_detail;
+
+	KVScheduler::KVScheduler(LlamaContext& context, size_t n_cache_reuse)
+		: context_(context), n_cache_reuse_(n_cache_reuse) {
 	}
 
 	void KVScheduler::prefill_text_cache(std::vector<llama_token> tokens) {
@@ -30,6 +70,98 @@ namespace llama_server::internal {
 	}
 
 	void KVScheduler::prefill_mtmd_cache(std::span<IDChunksPtr const> chunks) {
+		std::vector<PrefixCache::Key> prefix_keys;
+
+		// Another session may already hold a longer prefix of this prompt than our own KV.
+		if (context_.has_prefix_cache()) prefix_keys = PrefixCache::make_keys(chunks);
+		if (!prefix_keys.empty()) {
+			ChunksMatch own_match = match_chunks(chunks);
+			size_t n_restored = context_.restore_prefix(
+				std::span(prefix_keys).first(prefix_keys.size() - 1),
+				own_match.perfect_keep + own_match.last_keep
+			);
+			if (n_restored != 0) reset_chunks_info(chunks, n_restored);
+		}
+
+		ChunksMatch match = match_chunks(chunks);
+
+		// The KV can hold less than recorded, e.g. after a preempted generation could not restore its snapshot.
+		if (context_.get_used_memory() < match.perfect_keep + match.last_keep) {
+			prev_chunks_info_.clear();
+			match = match_chunks(chunks);
+		}
+
+		// Shifting cells of a sequence would move them for the prefix cache slots sharing them as well.
+		if (n_cache_reuse_ > 0 && !context_.has_prefix_cache() && context_.can_shift() && !uses_mrope_media(chunks)) {
+			match = reuse_chunks(chunks, match);
+		}
+
+		auto [kept_chunks, perfect_keep, last_keep] = match;
+
+		context_.KV_cleanup(perfect_keep + last_keep);
+
+		if (last_keep != 0) {
+			auto& last_chunk = chunks[kept_chunks];
+
+			auto& tokens = last_chunk->text_tokens;
+
+			try {
+				context_.text_prefill({ tokens.begin() + last_keep, tokens.end() }, kept_chunks == chunks.size() - 1);
+			}
+			catch (const DecodeAbortedException&) {
+				// The KV keeps what was decoded before the abort, the next request reuses it.
+				reset_chunks_info(chunks, context_.get_used_memory());
+				throw;
+			}
+			catch (const LlamaException& e) {
+				prev_chunks_info_.clear(); // Reset to prevent any unpredictable state;
+				throw LlamaException("Error prefilling cache: " + std::string(e.what()));
+			}
+		}
+
+		try {
+			context_.mtmd_prefill(chunks.subspan(kept_chunks + (last_keep != 0)));
+		}
+		catch (const DecodeAbortedException&) {
+			reset_chunks_info(chunks, context_.get_used_memory());
+			throw;
+		}
+		catch (const LlamaException& e) {
+			prev_chunks_info_.clear(); // Reset to prevent any unpredictable state;
+			throw LlamaException("Error prefilling cache: " + std::string(e.what()));
+		}
+
+		// Update previous chunks info.
+		prev_chunks_info_.resize(kept_chunks + (last_keep != 0));
+		prev_chunks_info_.reserve(chunks.size());
+
+		if (last_keep != 0) {
+			auto& chunk = chunks[kept_chunks];
+			auto& tokens = chunk->text_tokens;
+			auto& prev_tokens = prev_chunks_info_[kept_chunks].tokens;
+			prev_tokens.resize(last_keep);
+			prev_tokens.insert(prev_tokens.end(), tokens.begin() + last_keep, tokens.end());
+		}
+
+		for (auto& chunk : chunks | std::views::drop(kept_chunks + (last_keep != 0))) {
+			auto chunk_type = chunk->type;
+
+			if (chunk_type == IMAGE || chunk_type == AUDIO) {
+				prev_chunks_info_.emplace_back(ChunkInfo{ chunk_type, chunk->id, std::vector<llama_token>(), chunk->n_tokens });
+			}
+			else if (chunk_type == TEXT) {
+				size_t n_tokens;
+				auto& tokens = chunk->text_tokens;
+				prev_chunks_info_.emplace_back(ChunkInfo{ chunk_type, std::string(), tokens });
+			}
+		}
+
+		if (!prefix_keys.empty()) context_.store_prefix(prefix_keys);
+
+		log_info(std::format("KV Cache used: {}", context_.get_used_memory()));
+	}
+
+	KVScheduler::ChunksMatch KVScheduler::match_chunks(std::span<IDChunksPtr const> chunks) const {
 		size_t perfect_keep = 0;
 		size_t last_keep = 0;
 		size_t kept_chunks = 0;
@@ -70,55 +202,221 @@ namespace llama_server::internal {
 			kept_chunks += 1;
 		}
 
-		context_.KV_cleanup(perfect_keep + last_keep);
+		// At least one token has to be decoded to get the logits of the prompt.
+		if (kept_chunks != 0 && kept_chunks == chunks.size()) {
+			auto& last_chunk = chunks[--kept_chunks];
+			perfect_keep -= last_chunk->n_tokens;
+			if (last_chunk->type == TEXT) last_keep = last_chunk->text_tokens.size() - 1;
+		}
 
-		if (last_keep != 0) {
-			auto& last_chunk = chunks[kept_chunks];
+		return { kept_chunks, perfect_keep, last_keep };
+	}
 
-			auto& tokens = last_chunk->text_tokens;
+	KVScheduler::ChunksMatch KVScheduler::reuse_chunks(std::span<IDChunksPtr const> chunks, const ChunksMatch& match) {
+		std::vector<PrefixCache::Key> keys = PrefixCache::make_keys(chunks);
+		std::vector<PrefixCache::Key> prev_keys = make_prev_keys();
+		if (keys.empty()) return match;
 
-			try {
-				context_.text_prefill({ tokens.begin() + last_keep, tokens.end() }, kept_chunks == chunks.size() - 1);
+		// The last key is left to decode for the logits of the prompt.
+		const size_t n_keys = keys.size() - 1;
+		size_t head_p = match.perfect_keep + match.last_keep;
+		size_t head_c = head_p;
+		size_t n_reused = 0;
+
+		while (head_c < prev_keys.size() && head_p < n_keys) {
+			size_t n_match = 0;
+			while (
+				head_c + n_match < prev_keys.size() &&
+				head_p + n_match < n_keys &&
+				prev_keys[head_c + n_match] == keys[head_p + n_match]
+				) ++n_match;
+
+			while (n_match > 0 && PrefixCache::is_media_continuation(keys[head_p + n_match])) --n_match;
+
+			if (n_match == 0 || n_match < n_cache_reuse_) {
+				head_c += 1;
+				continue;
 			}
-			catch (const LlamaException& e) {
-				prev_chunks_info_.clear(); // Reset to prevent any unpredictable state;
-				throw LlamaException("Error prefilling cache: " + std::string(e.what()));
+
+			context_.KV_move(head_c, head_p, n_match);
+			head_c += n_match;
+			head_p += n_match;
+			n_reused += n_match;
+		}
+
+		if (n_reused == 0) return match;
+
+		log_info(std::format("KV Cache reused {} tokens after the common prefix of {}", n_reused, match.perfect_keep + match.last_keep));
+
+		// The KV now holds the first head_p positions of chunks, what is left past them is dropped by the caller.
+		reset_chunks_info(chunks, head_p);
+		return match_chunks(chunks);
+	}
+
+	bool KVScheduler::uses_mrope_media(std::span<IDChunksPtr const> chunks) const {
+		mtmd_context* mtmd = context_.get_model().get_mtmd();
+		if (!mtmd || !mtmd_decode_use_mrope(mtmd)) return false;
+
+		auto is_media = [](ChunksType type) { return type == IMAGE || type == AUDIO; };
+		return std::ranges::any_of(chunks, [&](const IDChunksPtr& chunk) { return is_media(chunk->type); })
+			|| std::ranges::any_of(prev_chunks_info_, [&](const ChunkInfo& info) { return is_media(info.type); });
+	}
+
+	std::vector<PrefixCache::Key> KVScheduler::make_prev_keys() const {
+		std::vector<PrefixCache::Key> keys;
+
+		for (auto& info : prev_chunks_info_) {
+			if (info.type == TEXT) keys.insert(keys.end(), info.tokens.begin(), info.tokens.end());
+			else for (size_t i = 0; i < info.n_tokens; i++) keys.emplace_back(PrefixCache::make_media_key(info.id, i));
+		}
+
+		return keys;
+	}
+
+	void KVScheduler::reset_chunks_info(std::span<IDChunksPtr const> chunks, size_t n_tokens) {
+		prev_chunks_info_.clear();
+
+		for (auto& chunk : chunks) {
+			if (n_tokens == 0) break;
+
+			if (chunk->type == TEXT) {
+				size_t n_take = std::min(n_tokens, chunk->text_tokens.size());
+				prev_chunks_info_.emplace_back(ChunkInfo{ TEXT, std::string(), { chunk->text_tokens.begin(), chunk->text_tokens.begin() + n_take } });
+				n_tokens -= n_take;
+			}
+			else {
+				if (n_tokens < chunk->n_tokens) break;
+				prev_chunks_info_.emplace_back(ChunkInfo{ chunk->type, chunk->id, std::vector<llama_token>(), chunk->n_tokens });
+				n_tokens -= chunk->n_tokens;
 			}
 		}
+	}
 
-		try {
-			context_.mtmd_prefill(chunks.subspan(kept_chunks + (last_keep != 0)));
+	void KVScheduler::save_state(const std::string& path) const {
+		std::vector<uint8_t> state = context_.get_state();
+
+		std::vector<StateChunk> chunks;
+		std::string data;
+		for (auto& info : prev_chunks_info_) {
+			StateChunk chunk{
+				.type = (uint32_t)info.type,
+				.id_size = (uint32_t)info.id.size(),
+				.id_offset = data.size(),
+				.n_tokens = info.type == TEXT ? info.tokens.size() : info.n_tokens
+			};
+			data += info.id;
+
+			data.resize(align_up(data.size(), alignof(llama_token)));
+			chunk.tokens_offset = data.size();
+			data.append(reinterpret_cast<const char*>(info.tokens.data()), info.tokens.size() * sizeof(llama_token));
+
+			chunks.emplace_back(chunk);
 		}
-		catch (const LlamaException& e) {
-			prev_chunks_info_.clear(); // Reset to prevent any unpredictable state;
-			throw LlamaException("Error prefilling cache: " + std::string(e.what()));
+
+		StateHeader header{
+			.version = state_version,
+			.n_vocab = (uint32_t)context_.get_n_vocab(),
+			.n_tokens = context_.get_used_memory(),
+			.n_chunks = chunks.size(),
+			.chunks_offset = sizeof(StateHeader),
+			.data_offset = sizeof(StateHeader) + chunks.size() * sizeof(StateChunk),
+			.data_size = data.size(),
+			.state_size = state.size()
+		};
+		std::memcpy(header.magic, state_magic, sizeof(state_magic));
+		header.state_offset = align_up(header.data_offset + header.data_size, state_alignment);
+
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		if (!file) throw LlamaException(std::format("Failed to open state file for writing: {}", path));
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(chunks.data()), chunks.size() * sizeof(StateChunk));
+		file.write(data.data(), data.size());
+		file.seekp(header.state_offset);
+		file.write(reinterpret_cast<const char*>(state.data()), state.size());
+
+		if (!file) throw LlamaException(std::format("Failed to write state file: {}", path));
+
+		log_info(std::format("Saved {} tokens of KV state to {}", header.n_tokens, path));
+	}
+
+	void KVScheduler::load_state(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) throw LlamaException(std::format("Failed to open state file: {}", path));
+
+		auto read_at = [&file, &path](uint64_t offset, void* dst, uint64_t size) {
+			file.seekg(offset);
+			file.read(static_cast<char*>(dst), size);
+			if (!file) throw LlamaException(std::format("Truncated state file: {}", path));
+		};
+
+		StateHeader header;
+		read_at(0, &header, sizeof(header));
+
+		if (std::memcmp(header.magic, state_magic, sizeof(state_magic)) != 0) {
+			throw LlamaException(std::format("Not a state file: {}", path));
+		}
+		if (header.version != state_version) {
+			throw LlamaException(std::format("Unsupported state file version {}: {}", header.version, path));
+		}
+		if (header.n_vocab != context_.get_n_vocab()) {
+			throw LlamaException(std::format("State file was saved with another model: {}", path));
+		}
+		if (header.n_tokens > context_.get_n_ctx()) {
+			throw LlamaException(std::format("State file holds {} tokens, more than the context size: {}", header.n_tokens, path));
 		}
 
-		// Update previous chunks info.
-		prev_chunks_info_.resize(kept_chunks);
-		prev_chunks_info_.reserve(chunks.size());
+		// Sizes come from the file, check them before allocating anything.
+		file.seekg(0, std::ios::end);
+		const uint64_t file_size = (uint64_t)file.tellg();
+		auto fits = [](uint64_t offset, uint64_t size, uint64_t limit) { return offset <= limit && size <= limit - offset; };
 
-		if (last_keep != 0) {
-			auto& chunk = chunks[kept_chunks];
-			auto& tokens = chunk->text_tokens;
-			auto& prev_tokens = prev_chunks_info_[kept_chunks].tokens;
-			prev_tokens.insert(prev_tokens.end(), tokens.begin() + last_keep, tokens.end());
+		if (header.n_chunks > file_size / sizeof(StateChunk) ||
+			!fits(header.chunks_offset, header.n_chunks * sizeof(StateChunk), file_size) ||
+			!fits(header.data_offset, header.data_size, file_size) ||
+			!fits(header.state_offset, header.state_size, file_size)) {
+			throw LlamaException(std::format("Corrupted state file: {}", path));
 		}
 
-		for (auto& chunk : chunks | std::views::drop(kept_chunks + (last_keep != 0))) {
-			auto chunk_type = chunk->type;
+		std::vector<StateChunk> chunks(header.n_chunks);
+		read_at(header.chunks_offset, chunks.data(), chunks.size() * sizeof(StateChunk));
 
-			if (chunk_type == IMAGE || chunk_type == AUDIO) {
-				prev_chunks_info_.emplace_back(ChunkInfo{ chunk_type, chunk->id, std::vector<llama_token>() });
-			}
-			else if (chunk_type == TEXT) {
-				size_t n_tokens;
-				auto& tokens = chunk->text_tokens;
-				prev_chunks_info_.emplace_back(ChunkInfo{ chunk_type, std::string(), tokens });
+		std::string data(header.data_size, '\0');
+		read_at(header.data_offset, data.data(), data.size());
+
+		std::vector<ChunkInfo> chunks_info;
+		for (auto& chunk : chunks) {
+			const bool is_text = (ChunksType)chunk.type == TEXT;
+			const uint64_t n_text_tokens = is_text ? chunk.n_tokens : 0;
+
+			if (!fits(chunk.id_offset, chunk.id_size, data.size()) ||
+				n_text_tokens > data.size() / sizeof(llama_token) ||
+				!fits(chunk.tokens_offset, n_text_tokens * sizeof(llama_token), data.size())) {
+				throw LlamaException(std::format("Corrupted state file: {}", path));
 			}
+
+			ChunkInfo info{ .type = (ChunksType)chunk.type, .id = data.substr(chunk.id_offset, chunk.id_size) };
+			if (!is_text) info.n_tokens = chunk.n_tokens;
+			info.tokens.resize(n_text_tokens);
+			std::memcpy(info.tokens.data(), data.data() + chunk.tokens_offset, n_text_tokens * sizeof(llama_token));
+
+			chunks_info.emplace_back(std::move(info));
 		}
 
-		log_info(std::format("KV Cache used: {}", context_.get_used_memory()));
+		std::vector<uint8_t> state(header.state_size);
+		read_at(header.state_offset, state.data(), state.size());
+
+		prev_chunks_info_.clear(); // The old KV is gone whatever happens below.
+		context_.set_state(state);
+
+		if (context_.get_used_memory() != header.n_tokens) {
+			context_.KV_cleanup(0);
+			throw LlamaException(std::format("Restored KV does not match the state file: {}", path));
+		}
+
+		prev_chunks_info_ = std::move(chunks_info);
+
+		log_info(std::format("Loaded {} tokens of KV state from {}", header.n_tokens, path));
 	}
 
 	void KVScheduler::clear() {
@@ -0,0 +1,46 @@
+#include "prompt_lookup.h"
+
+#include <algorithm>
+
+namespace llama_server::internal {
+
+	PromptLookup::PromptLookup(size_t n_gram)
+		: n_gram_(std::max<size_t>(n_gram, 1)) {}
+
+	std::vector<llama_token> PromptLookup::draft(std::span<const llama_token> tokens, size_t n_draft) {
+		std::vector<llama_token> drafted;
+		if (tokens.size() <= n_gram_ || n_draft == 0) return drafted;
+
+		if (n_indexed_ > tokens.size()) {
+			index_.clear();
+			n_indexed_ = 0;
+		}
+
+		// The trailing n-gram itself is left out, so it cannot match itself.
+		for (size_t end = std::max(n_indexed_, n_gram_); end < tokens.size(); end++) {
+			index_[hash(tokens.subspan(end - n_gram_, n_gram_))] = end;
+		}
+		n_indexed_ = tokens.size();
+
+		std::span<const llama_token> tail = tokens.last(n_gram_);
+		auto it = index_.find(hash(tail));
+		if (it == index_.end()) return drafted;
+
+		const size_t end = it->second;
+		if (!std::ranges::equal(tokens.subspan(end - n_gram_, n_gram_), tail)) return drafted;
+
+		const size_t n_take = std::min(n_draft, tokens.size() - end);
+		drafted.assign(tokens.begin() + end, tokens.begin() + end + n_take);
+		return drafted;
+	}
+
+	uint64_t PromptLookup::hash(std::span<const llama_token> ngram) const {
+		uint64_t h = 14695981039346656037ull;
+		for (llama_token token : ngram) {
+			h ^= (uint32_t)token;
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+}
@@ -1,12 +1,30 @@
 #include "sampler.h"
+#include "sampling_kernels.h"
 #include "llama_log.h"
 #include "llama_context.h"
-#include "common.h"
+#include "llama_model.h"
+#include "grammar_cache.h"
+#include "piece_table.h"
+#include "tokenizer.h"
 
+#include <algorithm>
+#include <cmath>
 #include <random>
+#include <format>
 
 namespace llama_server::internal {
 
+	namespace sampler_detail {
+
+		// Larger top_k is closer to a full sort, the generic chain handles it.
+		constexpr int32_t max_fast_top_k = 1024;
+		// Same floor as the top-p sampler of the generic chain.
+		constexpr size_t top_p_min_keep = 10;
+
+	}
+
+	using namespace sampler_detail;
+
 	// ===================================================================
 	// Sampler::SamplerDeleter
 	// ===================================================================
@@ -28,13 +46,12 @@ namespace llama_server::internal {
 		const Grammar& auto_grammar
 	) {
 		ptr_ = SamplerPtr(llama_sampler_chain_init(llama_sampler_chain_default_params()));
+		grammar_ = nullptr;
 
-		if (!gen_config.grammar.value.empty()) {
-			try { llama_sampler_chain_add(ptr_.get(), get_grammar_sampler(gen_config.grammar, context_.get_vocab())); }
-			catch (const LlamaException& e) { log_warn(e.what()); }
-		}
-		else if (!auto_grammar.value.empty()) {
-			try { llama_sampler_chain_add(ptr_.get(), get_grammar_sampler(auto_grammar, context_.get_vocab())); }
+		// The grammar stays out of the chain, it only masks the vocabulary when the unconstrained choice breaks it.
+		const Grammar& grammar = !gen_config.grammar.value.empty() ? gen_config.grammar : auto_grammar;
+		if (!grammar.value.empty()) {
+			try { grammar_ = SamplerPtr(context_.get_model().get_grammar_cache().acquire(grammar)); }
 			catch (const LlamaException& e) { log_warn(e.what()); }
 		}
 
@@ -54,101 +71,174 @@ namespace llama_server::internal {
 					gen_config.penalty_present
 				));
 		}
-		llama_sampler_chain_add(ptr_.get(), llama_sampler_init_dist(std::random_device()()));
+		const uint32_t seed = std::random_device()();
+		llama_sampler_chain_add(ptr_.get(), llama_sampler_init_dist(seed));
+
+		// Penalties need the whole vocabulary, they stay on the generic chain.
+		if (gen_config.penalty_last_n != 0) {
+			fast_path_ = FastPath::NONE;
+		}
+		else if (gen_config.temperature <= 0.0f || gen_config.top_k == 1) {
+			fast_path_ = FastPath::GREEDY;
+		}
+		else if (gen_config.top_k > 0 && gen_config.top_k <= max_fast_top_k) {
+			fast_path_ = FastPath::TOP_K;
+		}
+		else {
+			fast_path_ = FastPath::NONE;
+		}
+
+		temperature_ = gen_config.temperature;
+		top_p_ = gen_config.top_p;
+		top_k_ = gen_config.top_k > 0 ? (size_t)gen_config.top_k : 0;
+		rng_.seed(seed);
+
+		// Sampling then checking a single token equals masking first only when the draw is not truncated over the whole
+		// vocabulary: top-k and top-p would keep tokens the grammar rejects and drop allowed ones beyond the cut.
+		const bool truncated = (top_k_ > 0 && top_k_ < context_.get_n_vocab()) || (top_p_ > 0.0f && top_p_ < 1.0f);
+		check_first_ = fast_path_ == FastPath::GREEDY || !truncated;
 	}
 
 	llama_token Sampler::apply() {
-		const float* logits = llama_get_logits_ith(context_.get_data(), -1);
+		return apply(context_.get_logits());
+	}
+
+	llama_token Sampler::apply(const float* logits) {
+		llama_token result_token;
+		if (!grammar_) {
+			result_token = sample(logits);
+		}
+		else if (check_first_) {
+			// Most steps check a single token, the full mask is only built on rejection.
+			result_token = sample(logits);
+			if (!is_grammar_valid(result_token, logits[result_token])) result_token = sample_constrained(logits);
+		}
+		else {
+			result_token = sample_constrained(logits);
+		}
+
+		if (grammar_) llama_sampler_accept(grammar_.get(), result_token);
+		llama_sampler_accept(ptr_.get(), result_token);
+
+		return result_token;
+	}
+
+	std::vector<llama_token> Sampler::jump_forward(size_t n_max) {
+		std::vector<llama_token> forced;
+		if (!grammar_) return forced;
+
+		while (forced.size() < n_max) {
+			std::vector<llama_token> tokens = get_forced_tokens();
+			if (tokens.empty()) break;
+
+			for (llama_token token : tokens) {
+				// The retokenized common text may split differently from what the grammar accepts token by token.
+				if (forced.size() == n_max || !is_grammar_valid(token, 0.0f)) return forced;
+
+				llama_sampler_accept(grammar_.get(), token);
+				llama_sampler_accept(ptr_.get(), token);
+				forced.emplace_back(token);
+
+				if (llama_vocab_is_eog(context_.get_vocab(), token)) return forced;
+			}
+		}
+
+		return forced;
+	}
 
-		for (llama_token token_id = 0; token_id < context_.get_n_vocab(); token_id++) {
-			candidates_buffer_[token_id] = llama_token_data{ token_id, logits[token_id], 0.0f };
+	llama_token Sampler::sample(const float* logits) {
+		const size_t n_vocab = context_.get_n_vocab();
+
+		switch (fast_path_) {
+		case FastPath::GREEDY:
+			return sampling::argmax(logits, n_vocab);
+		case FastPath::TOP_K:
+			sampling::top_k(logits, n_vocab, top_k_, top_k_buffer_);
+			return sampling::sample_top_p(top_k_buffer_, temperature_, top_p_, std::min(top_p_min_keep, top_k_buffer_.size()), rng_);
+		default:
+			break;
 		}
 
+		llama_token_data_array data_array = fill_candidates(logits);
+		llama_sampler_apply(ptr_.get(), &data_array);
+
+		return get_selected(data_array);
+	}
+
+	llama_token Sampler::sample_constrained(const float* logits) {
+		llama_token_data_array data_array = fill_candidates(logits);
+		llama_sampler_apply(grammar_.get(), &data_array);
+		llama_sampler_apply(ptr_.get(), &data_array);
+
+		return get_selected(data_array);
+	}
+
+	bool Sampler::is_grammar_valid(llama_token token, float logit) {
+		llama_token_data single = { token, logit, 0.0f };
 		llama_token_data_array data_array = {
-			.data = candidates_buffer_.data(),
-			.size = candidates_buffer_.size(),
+			.data = &single,
+			.size = 1,
 			.selected = -1,
 			.sorted = false
 		};
 
-		llama_sampler_apply(ptr_.get(), &data_array);
+		llama_sampler_apply(grammar_.get(), &data_array);
 
-		if (data_array.selected < 0 || data_array.selected >= (int32_t)data_array.size) {
-			throw ContextGenerateDirtyException(std::format("Sampler failed to select a token. Returned value: {}", data_array.selected));
-		}
+		return !std::isinf(single.logit);
+	}
 
-		llama_token result_token = data_array.data[data_array.selected].id;
+	std::vector<llama_token> Sampler::get_forced_tokens() {
+		llama_token_data_array data_array = fill_candidates(nullptr);
+		llama_sampler_apply(grammar_.get(), &data_array);
 
-		llama_sampler_accept(ptr_.get(), result_token);
+		// A single allowed token is forced as is, an end of generation included.
+		// Otherwise only the text every allowed token starts with is certain: after "key" with a string or number value,
+		// the allowed ":", ": " and ": \"" only force ":", picking the longest would commit to a string.
+		const PieceTable& pieces = context_.get_model().get_pieces();
+		llama_token single = LLAMA_TOKEN_NULL;
+		size_t n_allowed = 0;
+		std::string_view common;
 
-		return result_token;
-	}
+		for (size_t i = 0; i < data_array.size; i++) {
+			const llama_token_data& candidate = data_array.data[i];
+			if (std::isinf(candidate.logit)) continue;
 
-	// Copy from sampling.cpp
-	llama_sampler* Sampler::get_grammar_sampler(const Grammar& grammar, const llama_vocab* vocab) {
-		struct llama_sampler* grmr;
-		if (grammar.value.compare(0, 11, "%llguidance") == 0) {
-#ifdef LLAMA_USE_LLGUIDANCE
-			grmr = llama_sampler_init_llg(vocab, "lark", grammar.value.c_str());
-#else
-			GGML_ABORT("llguidance (cmake -DLLAMA_LLGUIDANCE=ON) is not enabled");
-#endif // LLAMA_USE_LLGUIDANCE
+			single = candidate.id;
+			n_allowed++;
+
+			std::string_view piece = llama_vocab_is_eog(context_.get_vocab(), candidate.id) ? std::string_view() : pieces.get(candidate.id);
+			if (n_allowed == 1) common = piece;
+			else common = common.substr(0, std::ranges::mismatch(common, piece).in1 - common.begin());
+
+			if (n_allowed > 1 && common.empty()) return {};
 		}
-		else {
-			std::vector<std::string> trigger_patterns;
-			std::vector<std::string> patterns_anywhere;
-			std::vector<llama_token> trigger_tokens;
-			for (const auto& trigger : grammar.triggers) {
-				switch (trigger.type) {
-				case GrammarTrigger::WORD:
-				{
-					const auto& word = trigger.value;
-					patterns_anywhere.push_back(regex_escape(word));
-					break;
-				}
-				case GrammarTrigger::PATTERN:
-				{
-					patterns_anywhere.push_back(trigger.value);
-					break;
-				}
-				case GrammarTrigger::PATTERN_FULL:
-				{
-					trigger_patterns.push_back(trigger.value);
-					break;
-				}
-				case GrammarTrigger::TOKEN:
-				{
-					const auto token = trigger.token;
-					trigger_tokens.push_back(token);
-					break;
-				}
-				default:
-					GGML_ASSERT(false && "unknown trigger type");
-				}
-			}
 
-			if (!patterns_anywhere.empty()) {
-				trigger_patterns.push_back("^[\\s\\S]*?(" + string_join(patterns_anywhere, "|") + ")[\\s\\S]*");
-			}
+		if (n_allowed == 1) return { single };
+		if (common.empty()) return {};
 
-			std::vector<const char*> trigger_patterns_c;
-			trigger_patterns_c.reserve(trigger_patterns.size());
-			for (const auto& regex : trigger_patterns) {
-				trigger_patterns_c.push_back(regex.c_str());
-			}
+		return Tokenizer(context_.get_model()).text_tokenize(common, false, false);
+	}
 
-			grmr = grammar.lazy
-				? llama_sampler_init_grammar_lazy_patterns(vocab, grammar.value.c_str(), "root",
-					trigger_patterns_c.data(), trigger_patterns_c.size(),
-					trigger_tokens.data(), trigger_tokens.size())
-				: llama_sampler_init_grammar(vocab, grammar.value.c_str(), "root");
+	llama_token_data_array Sampler::fill_candidates(const float* logits) {
+		const size_t n_vocab = context_.get_n_vocab();
+		for (size_t i = 0; i < n_vocab; i++) {
+			candidates_buffer_[i] = llama_token_data{ (llama_token)i, logits ? logits[i] : 0.0f, 0.0f };
+		}
 
-			if (!grmr) {
-				throw LlamaException("Failed to initialize grammar sampler");
-			}
+		return llama_token_data_array{
+			.data = candidates_buffer_.data(),
+			.size = candidates_buffer_.size(),
+			.selected = -1,
+			.sorted = false
+		};
+	}
 
-			return grmr;
+	llama_token Sampler::get_selected(const llama_token_data_array& data_array) {
+		if (data_array.selected < 0 || data_array.selected >= (int32_t)data_array.size) {
+			throw ContextGenerateDirtyException(std::format("Sampler failed to select a token. Returned value: {}", data_array.selected));
 		}
+
+		return data_array.data[data_array.selected].id;
 	}
 
 }
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include "sampling_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace llama_server::internal::sampling {
+
+	namespace sampling_detail {
+
+		// Wide enough for AVX-512 floats, the fixed-width inner loops are vectorized by the compiler.
+		constexpr size_t lanes = 16;
+
+		inline float block_max(const float* values) {
+			float result = values[0];
+			for (size_t j = 1; j < lanes; j++) result = std::max(result, values[j]);
+			return result;
+		}
+
+	}
+
+	using namespace sampling_detail;
+
+	llama_token argmax(const float* logits, size_t n_vocab) {
+		float lane_max[lanes];
+		std::fill_n(lane_max, lanes, -std::numeric_limits<float>::infinity());
+
+		size_t i = 0;
+		for (; i + lanes <= n_vocab; i += lanes) {
+			for (size_t j = 0; j < lanes; j++) lane_max[j] = std::max(lane_max[j], logits[i + j]);
+		}
+
+		float best = block_max(lane_max);
+		for (; i < n_vocab; i++) best = std::max(best, logits[i]);
+
+		return (llama_token)(std::find(logits, logits + n_vocab, best) - logits);
+	}
+
+	void top_k(const float* logits, size_t n_vocab, size_t k, std::vector<llama_token_data>& out) {
+		k = std::min(k, n_vocab);
+		out.clear();
+		if (k == 0) return;
+
+		// Min-heap on the logit, its root is the threshold to enter the top k.
+		auto greater = [](const llama_token_data& lhs, const llama_token_data& rhs) { return lhs.logit > rhs.logit; };
+
+		for (size_t i = 0; i < k; i++) out.emplace_back(llama_token_data{ (llama_token)i, logits[i], 0.0f });
+		std::make_heap(out.begin(), out.end(), greater);
+		float threshold = out.front().logit;
+
+		auto offer = [&](size_t i) {
+			if (logits[i] <= threshold) return;
+			std::pop_heap(out.begin(), out.end(), greater);
+			out.back() = llama_token_data{ (llama_token)i, logits[i], 0.0f };
+			std::push_heap(out.begin(), out.end(), greater);
+			threshold = out.front().logit;
+		};
+
+		size_t i = k;
+		// Most blocks hold nothing above the threshold and are skipped after one vectorized max.
+		for (; i + lanes <= n_vocab; i += lanes) {
+			if (block_max(logits + i) <= threshold) continue;
+			for (size_t j = 0; j < lanes; j++) offer(i + j);
+		}
+		for (; i < n_vocab; i++) offer(i);
+
+		std::sort_heap(out.begin(), out.end(), greater);
+	}
+
+	llama_token sample_top_p(
+		std::span<llama_token_data> candidates,
+		float temperature,
+		float top_p,
+		size_t min_keep,
+		std::mt19937& rng
+	) {
+		const float inv_temperature = 1.0f / temperature;
+		const float max_logit = candidates.front().logit;
+
+		float sum = 0.0f;
+		for (auto& candidate : candidates) {
+			candidate.p = std::exp((candidate.logit - max_logit) * inv_temperature);
+			sum += candidate.p;
+		}
+
+		size_t n_keep = candidates.size();
+		float kept = sum;
+		if (top_p > 0.0f && top_p < 1.0f) {
+			float cumulative = 0.0f;
+			for (size_t i = 0; i < candidates.size(); i++) {
+				cumulative += candidates[i].p;
+				if (cumulative >= top_p * sum && i + 1 >= min_keep) {
+					n_keep = i + 1;
+					kept = cumulative;
+					break;
+				}
+			}
+		}
+
+		float r = std::uniform_real_distribution<float>(0.0f, kept)(rng);
+		for (size_t i = 0; i < n_keep; i++) {
+			r -= candidates[i].p;
+			if (r < 0.0f) return candidates[i].id;
+		}
+		return candidates[n_keep - 1].id;
+	}
+
+}
@@ -1,21 +1,105 @@
 #include "streamer.h"
 
 #include <ranges>
+#include <deque>
 
 namespace llama_server::internal {
 
-	Streamer::Streamer() {}
+	Streamer::Streamer() { set_stop({}); }
+
+	void Streamer::set_stop(const std::vector<std::string>& stop) {
+		nodes_.assign(1, Node{});
+		nodes_[0].next.fill(-1);
+		state_ = 0;
+		held_.clear();
+
+		for (const auto& pattern : stop) {
+			if (pattern.empty()) continue;
+
+			int32_t node = 0;
+			for (unsigned char c : pattern) {
+				if (nodes_[node].next[c] < 0) {
+					Node child;
+					child.next.fill(-1);
+					child.depth = nodes_[node].depth + 1;
+					nodes_[node].next[c] = (int32_t)nodes_.size();
+					nodes_.emplace_back(child);
+				}
+				node = nodes_[node].next[c];
+			}
+			nodes_[node].terminal = true;
+		}
+
+		// Breadth first, so fail links point to shallower nodes whose transitions are already complete.
+		std::deque<int32_t> queue;
+		for (auto& child : nodes_[0].next) {
+			if (child < 0) child = 0;
+			else queue.emplace_back(child);
+		}
+
+		while (!queue.empty()) {
+			int32_t node = queue.front();
+			queue.pop_front();
+
+			for (size_t c = 0; c < 256; c++) {
+				int32_t child = nodes_[node].next[c];
+				int32_t fallback = nodes_[nodes_[node].fail].next[c];
+
+				if (child < 0) {
+					nodes_[node].next[c] = fallback;
+					continue;
+				}
+
+				nodes_[child].fail = fallback;
+				nodes_[child].terminal = nodes_[child].terminal || nodes_[fallback].terminal;
+				queue.emplace_back(child);
+			}
+		}
+	}
 
 	bool Streamer::process(
 		std::string& buffer,
 		StreamCallback callback
 	) {
-		if (validate_utf8_end(buffer)) {
+		if (!validate_utf8_end(buffer)) return true;
+
+		if (nodes_.size() == 1) {
 			std::string result = std::move(buffer);
 			buffer.clear();
 			return callback(std::move(result));
 		}
-		return true;
+
+		const size_t n_held = held_.size();
+		held_ += buffer;
+		buffer.clear();
+
+		for (size_t i = n_held; i < held_.size(); i++) {
+			state_ = nodes_[state_].next[(unsigned char)held_[i]];
+			if (!nodes_[state_].terminal) continue;
+
+			// Text after the stop string is never generated as far as the caller is concerned.
+			std::string result = held_.substr(0, i + 1);
+			held_.clear();
+			state_ = 0;
+			callback(std::move(result));
+			return false;
+		}
+
+		const size_t n_release = held_.size() - nodes_[state_].depth;
+		if (n_release == 0) return true;
+
+		std::string result = held_.substr(0, n_release);
+		held_.erase(0, n_release);
+		return callback(std::move(result));
+	}
+
+	bool Streamer::flush(StreamCallback callback) {
+		state_ = 0;
+		if (held_.empty()) return true;
+
+		std::string result = std::move(held_);
+		held_.clear();
+		return callback(std::move(result));
 	}
 
 	bool Streamer::validate_utf8_end(std::string_view buffer) {
@@ -1,5 +1,7 @@
 #include "tokenizer.h"
 #include "llama_model.h"
+#include "piece_table.h"
+#include "token_cache.h"
 
 #include <format>
 
@@ -15,6 +17,9 @@ namespace llama_server::internal {
 		bool add_special,
 		bool parse_special
 	) const {
+		TokenCache& cache = model_.get_token_cache();
+		if (auto cached = cache.find(text, add_special, parse_special)) return std::move(*cached);
+
 		int32_t estimated_size = text.size() + (add_special ? 2 : 0);
 		const int32_t try_cap = 2;
 
@@ -42,6 +47,7 @@ namespace llama_server::internal {
 		if (n_tokens < 0) throw LlamaException(std::format("Tokenization overflow, final estimated_size = {}, result_size = {}", estimated_size, -n_tokens));
 
 		tokens.resize(n_tokens);
+		cache.insert(text, add_special, parse_special, tokens);
 
 		return tokens;
 	}
@@ -50,6 +56,9 @@ namespace llama_server::internal {
 		llama_token token,
 		bool add_special
 	) const {
+		// Only rendering special tokens needs llama_token_to_piece.
+		if (!add_special && model_.get_pieces().contains(token)) return std::string(model_.get_pieces().get(token));
+
 		std::string buffer(256, '\0');
 
 		const int32_t n_chars = llama_token_to_piece(
@@ -68,6 +77,12 @@ namespace llama_server::internal {
 		return buffer;
 	}
 
+	std::string_view Tokenizer::get_piece(llama_token token) const {
+		if (!model_.get_pieces().contains(token)) throw LlamaException(std::format("Token {} is out of the vocabulary.", token));
+
+		return model_.get_pieces().get(token);
+	}
+
 	mtmd::input_chunks_ptr Tokenizer::mtmd_tokenize(
 		std::string_view text,
 		mtmd::bitmaps& bitmaps,
@@ -1 +1,139 @@
 #include "utils.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <format>
+#include <iterator>
+
+namespace llama_server::internal {
+
+	// ===================================================================
+	// ThreadPool
+	// ===================================================================
+
+	ThreadPool::ThreadPool(size_t n_threads) {
+		for (size_t i = 0; i < n_threads; i++) {
+			workers_.emplace_back([this] {
+				while (true) {
+					std::function<void()> task;
+					{
+						std::unique_lock lock(mutex_);
+						cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+						if (tasks_.empty()) return;
+
+						task = std::move(tasks_.front());
+						tasks_.pop();
+					}
+					task();
+				}
+			});
+		}
+	}
+
+	ThreadPool::~ThreadPool() {
+		{
+			std::lock_guard lock(mutex_);
+			stop_ = true;
+		}
+		cv_.notify_all();
+
+		for (auto& worker : workers_) worker.join();
+	}
+
+	// ===================================================================
+	// Utilities
+	// ===================================================================
+
+	void prefetch_file(std::string_view path) {
+		std::ifstream file(std::string(path), std::ios::binary);
+		if (!file) return;
+
+		std::vector<char> buffer(1 << 20);
+		while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {}
+	}
+
+	std::string read_file(std::string_view path) {
+		std::ifstream file(std::string(path), std::ios::binary);
+		if (!file) throw LlamaException(std::format("Failed to open file: {}", path));
+
+		std::string content{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+		if (file.bad()) throw LlamaException(std::format("Failed to read file: {}", path));
+
+		return content;
+	}
+
+	// ===================================================================
+	// MappedFile
+	// ===================================================================
+
+#ifdef _WIN32
+	MappedFile::MappedFile(std::string_view path) {
+		const std::filesystem::path file_path(path);
+
+		file_ = CreateFileW(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file_ == INVALID_HANDLE_VALUE) {
+			file_ = nullptr;
+			throw LlamaException(std::format("Failed to open file: {}", path));
+		}
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file_, &file_size) || file_size.QuadPart == 0) {
+			CloseHandle(file_);
+			throw LlamaException(std::format("Failed to map empty or unreadable file: {}", path));
+		}
+		size_ = (size_t)file_size.QuadPart;
+
+		mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping_) {
+			CloseHandle(file_);
+			throw LlamaException(std::format("Failed to map file: {}", path));
+		}
+
+		data_ = (const uint8_t*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+		if (!data_) {
+			CloseHandle(mapping_);
+			CloseHandle(file_);
+			throw LlamaException(std::format("Failed to map file: {}", path));
+		}
+	}
+
+	MappedFile::~MappedFile() {
+		UnmapViewOfFile(data_);
+		CloseHandle(mapping_);
+		CloseHandle(file_);
+	}
+#else
+	MappedFile::MappedFile(std::string_view path) {
+		const int fd = open(std::string(path).c_str(), O_RDONLY);
+		if (fd < 0) throw LlamaException(std::format("Failed to open file: {}", path));
+
+		struct stat file_stat;
+		if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+			close(fd);
+			throw LlamaException(std::format("Failed to map empty or unreadable file: {}", path));
+		}
+		size_ = (size_t)file_stat.st_size;
+
+		void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) throw LlamaException(std::format("Failed to map file: {}", path));
+
+		data_ = (const uint8_t*)data;
+	}
+
+	MappedFile::~MappedFile() { munmap((void*)data_, size_); }
+#endif
+
+}
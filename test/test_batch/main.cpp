@@ -0,0 +1,119 @@
+#include "model_server.h"
+#include "llama_configs.h"
+#include "llama_inputs.h"
+#include "llama_session.h"
+
+#include <windows.h>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <consoleapi2.h>
+#include <chrono>
+#include <format>
+#include <algorithm>
+
+using namespace llama_server;
+
+int main(int argc, char* argv[]) {
+	SetConsoleOutputCP(65001);
+	SetConsoleCP(65001);
+
+	ModelServer& server = ModelServer::get_server();
+
+	const uint32_t n_parallel = 4;
+
+	server.load_model(
+		ModelConfig{
+			.model_path = "D:/CraftTools/AI/my_ai_assistant/model/MiniCPM-V-4_5-Q4_K_M.gguf",
+			.n_parallel = n_parallel,
+			.batch_context = {
+				.n_ctx = 4096 * n_parallel,
+				.n_batch = 2048,
+				.n_ubatch = 512,
+			},
+		},
+		"MiniCPM-V-4.5"
+	);
+
+	// Aggregate tokens/s should grow with the number of concurrent sessions.
+	for (uint32_t n_sessions = 1; n_sessions <= n_parallel; n_sessions *= 2) {
+		std::atomic<size_t> n_pieces = 0;
+		std::vector<std::thread> workers;
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+
+		for (uint32_t i = 0; i < n_sessions; i++) {
+			workers.emplace_back([&server, &n_pieces, i] {
+				std::unique_ptr<LlamaSession> session = server.get_session(
+					"MiniCPM-V-4.5",
+					ContextConfig{ .n_ctx = 4096 }
+				);
+
+				std::vector<Message> head_msgs;
+				std::vector<Message> tail_msgs;
+				std::vector<Tool> tools;
+
+				tail_msgs.emplace_back(
+					Message{
+						.role = "user",
+						.content = std::format("写一篇关于第{}个季节的短文。", i + 1)
+					}
+				);
+
+				session->generate(
+					head_msgs, tail_msgs, tools,
+					GenConfig{
+						.max_tokens = 256,
+						.temperature = 0.4f,
+						.top_k = 200,
+						.output_callback = [&n_pieces](std::string&& text) { n_pieces++; return true; }
+					}
+				);
+			});
+		}
+
+		for (auto& worker : workers) worker.join();
+
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_time).count();
+		std::cout << std::format("[{} sessions] {} pieces in {}ms, {:.2f} pieces/s", n_sessions, n_pieces.load(), duration, n_pieces * 1000.0 / duration) << std::endl;
+	}
+
+	// The same load from one thread, reading whichever stream has its next token ready.
+	{
+		std::vector<std::unique_ptr<LlamaSession>> sessions;
+		std::vector<TokenStream> streams;
+		size_t n_pieces = 0;
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+
+		for (uint32_t i = 0; i < n_parallel; i++) {
+			sessions.emplace_back(server.get_session("MiniCPM-V-4.5", ContextConfig{ .n_ctx = 4096 }));
+
+			std::vector<Message> tail_msgs;
+			tail_msgs.emplace_back(
+				Message{
+					.role = "user",
+					.content = std::format("写一篇关于第{}个季节的短文。", i + 1)
+				}
+			);
+
+			streams.emplace_back(sessions.back()->generate_stream({}, tail_msgs, {}, GenConfig{ .max_tokens = 256, .temperature = 0.4f, .top_k = 200 }));
+		}
+
+		while (std::any_of(streams.begin(), streams.end(), [](const TokenStream& stream) { return !stream.finished(); })) {
+			for (auto& stream : streams) {
+				if (stream.finished() || !stream.ready()) continue;
+				if (stream.next()) n_pieces++;
+			}
+		}
+
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_time).count();
+		std::cout << std::format("[{} streams, 1 thread] {} pieces in {}ms, {:.2f} pieces/s", n_parallel, n_pieces, duration, n_pieces * 1000.0 / duration) << std::endl;
+	}
+
+	server.shutdown();
+
+	system("pause");
+}
\ No newline at end of file
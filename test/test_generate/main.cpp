@@ -68,49 +68,33 @@ int main(int argc, char* argv[]) {
 	struct simple_output {
 		std::string response_buffer;
 
-		std::string tool_start_pattern = "<tool_call>";
-		std::string tool_end_pattern = "</tool_call>";
-		bool tool_calling = false;
-		std::string tool_call_buffer;
-		std::string tool_result_buffer;
-
-		ToolCallback tcb;
-
 		OutputCallback cb = [&](std::string&& text) {
 			response_buffer += text;
 			std::cout << text;
+			return true;
+		};
+	};
+	simple_output so;
 
-			if (tool_calling) {
-				size_t end_pos = text.find(tool_end_pattern);
-				if (end_pos != std::string::npos) {
-					tool_call_buffer += text.substr(0, end_pos);
-					tool_result_buffer = tcb(tool_call_buffer);
-					return false;
-				}
-				tool_call_buffer += text;
-				return true;
-			}
+	const std::string tool_start_pattern = "<tool_call>";
+	const std::string tool_end_pattern = "</tool_call>";
 
-			size_t start_pos = text.find(tool_start_pattern);
-			if (start_pos != std::string::npos) {
-				tool_calling = true;
-				tool_call_buffer.clear();
-				tool_call_buffer += text.substr(start_pos + tool_start_pattern.size());
-				return true;
-			}
+	// Generation stops right after the closing tag, so a tool call always ends the response.
+	auto extract_tool_call = [&](std::string_view response) -> std::string {
+		if (!response.ends_with(tool_end_pattern)) return {};
 
-			return true;
-		};
+		size_t start_pos = response.rfind(tool_start_pattern);
+		if (start_pos == std::string::npos) return {};
+
+		start_pos += tool_start_pattern.size();
+		return std::string(response.substr(start_pos, response.size() - tool_end_pattern.size() - start_pos));
 	};
-    simple_output so;
-	so.tcb = tool_callback;
+
 	while (true) {
 		std::string input;
 		std::getline(std::cin, input);
 
 		so.response_buffer = std::string();
-		so.tool_result_buffer = std::string();
-		so.tool_call_buffer = std::string();
 
 		tail_msgs.emplace_back(
 			Message{
@@ -125,9 +109,12 @@ int main(int argc, char* argv[]) {
 				.top_k = 200,
 				.penalty_last_n = 10,
 				.penalty_repeat = 1.05f,
+				.stop = { .strings = { tool_end_pattern } },
 				.output_callback = so.cb
 			}
 		);
+
+		std::string tool_call = extract_tool_call(so.response_buffer);
 		tail_msgs.emplace_back(
 			Message{
 				.role = "assistant",
@@ -137,14 +124,14 @@ int main(int argc, char* argv[]) {
 
 		std::cout << std::endl;
 
-		if (so.tool_result_buffer.empty()) continue;
+		if (tool_call.empty()) continue;
 
 		so.response_buffer = std::string();
 
 		tail_msgs.emplace_back(
 			Message{
 				.role = "tool",
-				.content = std::move(so.tool_result_buffer)
+				.content = tool_callback(tool_call)
 			}
 		);
 		session->generate(
@@ -152,6 +139,7 @@ int main(int argc, char* argv[]) {
 			GenConfig{
 				.temperature = 0.2f,
 				.top_k = 100,
+				.stop = { .strings = { tool_end_pattern } },
 				.output_callback = so.cb
 			}
 		);
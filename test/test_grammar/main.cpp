@@ -97,6 +97,7 @@ int main(int argc, char* argv[]) {
 		head_msgs, tail_msgs, tools,
 		GenConfig{
 			.enable_thinking = false,
+			.jump_forward = true,
 			.temperature = 0.4f,
 			.top_k = 40,
 			.penalty_last_n = 64,
@@ -108,6 +109,10 @@ int main(int argc, char* argv[]) {
 
 	std::cout << std::endl;
 
+	// The second turn reuses the grammar compiled by the first one.
+	ModelStats stats = server.get_model_stats("MiniCPM-V-4.5");
+	std::cout << "Grammar cache hits: " << stats.grammar_cache_hits << ", misses: " << stats.grammar_cache_misses << std::endl;
+
 	server.shutdown();
 
 	system("pause");
@@ -0,0 +1,103 @@
+#include "sampling_kernels.h"
+#include "llama.h"
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include <format>
+#include <functional>
+#include <algorithm>
+
+using namespace llama_server::internal;
+
+namespace {
+
+	// Vocabulary size of Qwen-family models, the sampler runs over the whole of it once per token.
+	constexpr size_t n_vocab = 151936;
+	constexpr int n_iterations = 500;
+
+	double time_us(const std::function<llama_token()>& sample, llama_token& last) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < n_iterations; i++) last = sample();
+		auto end = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::micro>(end - start).count() / n_iterations;
+	}
+
+	llama_token chain_sample(llama_sampler* chain, const std::vector<float>& logits, std::vector<llama_token_data>& candidates) {
+		for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+			candidates[token_id] = llama_token_data{ token_id, logits[token_id], 0.0f };
+		}
+
+		llama_token_data_array data_array = {
+			.data = candidates.data(),
+			.size = candidates.size(),
+			.selected = -1,
+			.sorted = false
+		};
+		llama_sampler_apply(chain, &data_array);
+
+		return data_array.data[data_array.selected].id;
+	}
+
+}
+
+int main(int argc, char* argv[]) {
+	std::mt19937 rng(42);
+	std::normal_distribution<float> dist(0.0f, 4.0f);
+
+	std::vector<float> logits(n_vocab);
+	for (auto& logit : logits) logit = dist(rng);
+	std::vector<llama_token_data> candidates(n_vocab);
+
+	// Greedy
+	{
+		llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+		llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+
+		llama_token chain_token = -1, kernel_token = -1;
+		double chain_us = time_us([&] { return chain_sample(chain, logits, candidates); }, chain_token);
+		double kernel_us = time_us([&] { return sampling::argmax(logits.data(), n_vocab); }, kernel_token);
+
+		std::cout << std::format("Greedy:  chain {:8.1f} us, kernel {:8.1f} us, speedup {:5.1f}x, same token: {}\n",
+			chain_us, kernel_us, chain_us / kernel_us, chain_token == kernel_token);
+
+		llama_sampler_free(chain);
+	}
+
+	// temperature 0.7, top_k 40, top_p 0.9
+	{
+		llama_sampler* chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+		llama_sampler_chain_add(chain, llama_sampler_init_temp(0.7f));
+		llama_sampler_chain_add(chain, llama_sampler_init_top_k(40));
+		llama_sampler_chain_add(chain, llama_sampler_init_top_p(0.9f, 10));
+		llama_sampler_chain_add(chain, llama_sampler_init_dist(42));
+
+		std::vector<llama_token_data> top_k;
+		std::mt19937 kernel_rng(42);
+
+		llama_token chain_token = -1, kernel_token = -1;
+		double chain_us = time_us([&] { return chain_sample(chain, logits, candidates); }, chain_token);
+		double kernel_us = time_us([&] {
+			sampling::top_k(logits.data(), n_vocab, 40, top_k);
+			return sampling::sample_top_p(top_k, 0.7f, 0.9f, 10, kernel_rng);
+		}, kernel_token);
+
+		std::cout << std::format("Top-k:   chain {:8.1f} us, kernel {:8.1f} us, speedup {:5.1f}x\n",
+			chain_us, kernel_us, chain_us / kernel_us);
+
+		// Both must pick their candidates from the same set.
+		std::vector<llama_token_data> sorted(n_vocab);
+		for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) sorted[token_id] = { token_id, logits[token_id], 0.0f };
+		std::partial_sort(sorted.begin(), sorted.begin() + 40, sorted.end(), [](const llama_token_data& lhs, const llama_token_data& rhs) {
+			return lhs.logit > rhs.logit;
+		});
+		bool same_set = true;
+		for (size_t i = 0; i < top_k.size(); i++) same_set &= top_k[i].id == sorted[i].id;
+		std::cout << std::format("Top-k:   same candidates: {}\n", same_set);
+
+		llama_sampler_free(chain);
+	}
+
+	return 0;
+}
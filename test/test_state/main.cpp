@@ -0,0 +1,94 @@
+#include "model_server.h"
+#include "llama_configs.h"
+#include "llama_inputs.h"
+#include "llama_session.h"
+
+#include <windows.h>
+#include <memory>
+#include <iostream>
+#include <consoleapi2.h>
+#include <chrono>
+
+using namespace llama_server;
+
+int main(int argc, char* argv[]) {
+	SetConsoleOutputCP(65001);
+	SetConsoleCP(65001);
+
+	ModelServer& server = ModelServer::get_server();
+
+	server.load_model(
+		ModelConfig{
+			.model_path = "D:/CraftTools/AI/my_ai_assistant/model/MiniCPM-V-4_5-Q4_K_M.gguf",
+			.n_gpu_layers = 99,
+		},
+		"MiniCPM-V-4.5"
+	);
+
+	std::vector<Message> head_msgs;
+	std::vector<Message> tail_msgs;
+	std::vector<Tool> tools;
+
+	struct simple_output {
+		std::string response_buffer;
+
+		std::chrono::high_resolution_clock::time_point start_time;
+		bool is_first_token = true;
+
+		OutputCallback cb = [&](std::string&& text) {
+			if (is_first_token) {
+				auto now = std::chrono::high_resolution_clock::now();
+				auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
+
+				std::cout << " [TTFT: " << duration << "ms] ";
+
+				is_first_token = false;
+			}
+
+			response_buffer += text;
+			std::cout << text;
+
+			return true;
+		};
+	};
+	simple_output so;
+
+	auto chat = [&](LlamaSession& session, std::string input) {
+		so.response_buffer = std::string();
+		so.is_first_token = true;
+
+		tail_msgs.emplace_back(Message{ .role = "user", .content = std::move(input) });
+
+		so.start_time = std::chrono::high_resolution_clock::now();
+		session.generate(
+			head_msgs, tail_msgs, tools,
+			GenConfig{
+				.max_tokens = 256,
+				.temperature = 0.4f,
+				.top_k = 200,
+				.output_callback = so.cb
+			}
+		);
+
+		tail_msgs.emplace_back(Message{ .role = "assistant", .content = std::move(so.response_buffer) });
+		std::cout << std::endl;
+	};
+
+	{
+		std::unique_ptr<LlamaSession> session = server.get_session("MiniCPM-V-4.5", ContextConfig{ .n_ctx = 8192 });
+
+		for (int i = 0; i < 8; ++i) chat(*session, "请详细介绍一种你喜欢的植物，越长越好。");
+
+		session->save_state("./session_state.bin");
+	}
+
+	// TTFT of the restored session should only cover the new message.
+	std::unique_ptr<LlamaSession> session = server.get_session("MiniCPM-V-4.5", ContextConfig{ .n_ctx = 8192 });
+	session->load_state("./session_state.bin");
+
+	chat(*session, "总结一下我们刚才的对话。");
+
+	server.shutdown();
+
+	system("pause");
+}
\ No newline at end of file